@@ -0,0 +1,4 @@
+(define fib (lambda (n) (if (eq? n 0) 0 (if (eq? n 1) 1 (add (fib (sub n 1)) (fib (sub n 2)))))))
+(define loop (lambda (i acc) (if (eq? i 0) acc (loop (sub i 1) (add acc (fib 10))))))
+(fib 25)
+(loop 2000 0)
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Runs bench/eval.lisp under the tree walker, the bytecode VM, the VM
+# with its JIT and translated ahead of time to C, checking that they
+# agree, and reports the wall time of each.
+set -e
+root=$(cd "$(dirname "$0")/.." && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+${CC:-cc} -O2 -o "$tmp/lisp" "$root/lisp.c" -lm -lpthread
+"$tmp/lisp" --aot < "$root/bench/eval.lisp" > "$tmp/aot.c"
+${CC:-cc} -O2 -I"$root" -o "$tmp/aot" "$tmp/aot.c" -lm -lpthread
+
+for opts in "--eval=tree" "--eval=vm --jit-threshold=0" "--eval=vm" "aot"; do
+  start=$(date +%s%N)
+  if [ "$opts" = aot ]; then
+    "$tmp/aot" > "$tmp/out"
+  else
+    "$tmp/lisp" $opts < "$root/bench/eval.lisp" > "$tmp/out"
+  fi
+  end=$(date +%s%N)
+  echo "$opts: $(( (end - start) / 1000000 )) ms"
+  [ -f "$tmp/expected" ] || cp "$tmp/out" "$tmp/expected"
+  cmp -s "$tmp/expected" "$tmp/out" || echo "output differs from --eval=tree"
+done
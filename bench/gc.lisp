@@ -0,0 +1,7 @@
+(define build (lambda (n acc) (if (eq? n 0) acc (build (sub n 1) (cons n acc)))))
+(define churn (lambda (i keep) (build 200 (quote ())) (if (eq? i 0) (quote done) (churn (sub i 1) (cons (build 20 (quote ())) keep)))))
+(churn 3000 (quote ()))
+(churn 3000 (quote ()))
+(churn 3000 (quote ()))
+(churn 3000 (quote ()))
+(churn 3000 (quote ()))
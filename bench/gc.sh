@@ -0,0 +1,19 @@
+#!/bin/sh
+# Runs bench/gc.lisp under each collector and reports wall time, peak
+# resident memory and collection counts.
+set -e
+root=$(cd "$(dirname "$0")/.." && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+${CC:-cc} -O2 -o "$tmp/lisp" "$root/lisp.c" -lm -lpthread
+
+threads=$(nproc 2>/dev/null || echo 4)
+for opts in "--gc=copy --nursery=0" "--gc=copy --nursery=0 --gc-threads=$threads" \
+            "--gc=copy --nursery=0 --large-heap" "--gc=copy" "--gc=compact"; do
+  start=$(date +%s%N)
+  "$tmp/lisp" $opts --gc-stats < "$root/bench/gc.lisp" > /dev/null 2> "$tmp/stats"
+  end=$(date +%s%N)
+  echo "== $opts"
+  echo "wall time: $(( (end - start) / 1000000 )) ms"
+  cat "$tmp/stats"
+done
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Reads the same number of symbols drawn from vocabularies of growing
+# size, which should take flat time as the symbol table grows, then one
+# list of a million numbers, reporting the wall time and parse
+# throughput of each run.
+set -e
+root=$(cd "$(dirname "$0")/.." && pwd)
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+${CC:-cc} -O2 -o "$tmp/lisp" "$root/lisp.c" -lm -lpthread
+
+run() {
+  start=$(date +%s%N)
+  "$tmp/lisp" < "$tmp/input.lisp" > /dev/null
+  end=$(date +%s%N)
+  bytes=$(wc -c < "$tmp/input.lisp")
+  ms=$(( (end - start) / 1000000 ))
+  echo "$1: $bytes bytes in $ms ms, $(( bytes / ((end - start) / 1000 + 1) )) MB/s"
+}
+
+reads=${READS:-200000}
+for n in 100 1000 10000 100000; do
+  awk -v n=$n -v reads=$reads 'BEGIN {
+    for(i = 0; i < reads; i += 50) {
+      printf "(length (quote (";
+      for(j = 0; j < 50; j++) {
+        printf " s%d", ((i + j) * 7919) % n;
+      }
+      print ")))";
+    }
+  }' > "$tmp/input.lisp"
+  run "$n symbols: $reads reads"
+done
+
+awk 'BEGIN {
+  printf "(length (quote (";
+  for(i = 0; i < 1000000; i++) {
+    printf " %d", i * 7919;
+  }
+  print ")))";
+}' > "$tmp/input.lisp"
+run "one list of 1000000 numbers"
@@ -2,11 +2,23 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <math.h>
 #include <errno.h>
 #include <string.h>
 #include <ctype.h>
 #include <execinfo.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 /* UTILS */
 
@@ -35,37 +47,207 @@ void assert(bool r) {
   }
 }
 
-typedef struct vector_t {
-  void **elements;
+typedef struct id_stack_t {
+  uint64_t *ids;
   uint64_t size;
   uint64_t used;
-} vector_t;
+} id_stack_t;
 
-vector_t* make_vector(uint64_t size) {
-  vector_t *vector = (vector_t*)malloc(sizeof(vector_t));
-  vector->size = size;
-  vector->used = 0;
-  vector->elements = (void**)malloc(sizeof(void*)*vector->size);
-  return vector;
+void push_id(id_stack_t *stack, uint64_t id) {
+  if(stack->used >= stack->size) {
+    stack->size = stack->size > 0 ? stack->size * 2 : 64;
+    stack->ids = (uint64_t*)realloc(stack->ids, sizeof(uint64_t) * stack->size);
+  }
+  stack->ids[stack->used++] = id;
 }
 
-void free_vector(vector_t *vector) {
-  uint64_t i;
-  for(i = 0; i<vector->used; i++){
-    free(vector->elements[i]);
+/* Symbols are interned in an open-addressing hash table with linear
+   probing. A symbol id indexes names, the offset of its nul-terminated
+   name in the string arena, and hashes, the hash of that name, so that
+   probes compare hashes before any string and growing the table does
+   not rehash the names. Slots hold an id plus one, zero being empty,
+   and are kept at most half full.
+
+   Symbols are weak: full and incremental collections mark the ones
+   they reach, and sweep_symbols frees the rest except for the first
+   pinned ids, which setup_env interns. Like pairs, a symbol has to be
+   reachable from the roots across any allocation to survive. Freed ids
+   are reused, and the arena is compacted once most of it holds freed
+   names. Minor collections do not sweep, so once the symbols in use
+   outgrow limit the next collection is a full one. Uninterned symbols made by gensym have an id and a name but
+   no slot, so no other symbol is ever eq to them. */
+enum {
+  SYMBOL_FREE = 1,
+  SYMBOL_UNINTERNED = 2
+};
+
+#define SYMBOL_LIMIT_MIN 1024
+
+typedef struct symbol_table_t {
+  char *arena;
+  uint64_t asize;
+  uint64_t aused;
+  uint64_t garbage;
+  uint64_t *names;
+  uint64_t *hashes;
+  uint8_t *flags;
+  bool *marks;
+  uint64_t size;
+  uint64_t used;
+  uint64_t pinned;
+  uint64_t limit;
+  uint64_t gensyms;
+  id_stack_t free_ids;
+  uint64_t *slots;
+  uint64_t nslots;
+} symbol_table_t;
+
+symbol_table_t* make_symbol_table(uint64_t size) {
+  symbol_table_t *table = (symbol_table_t*)malloc(sizeof(symbol_table_t));
+  table->asize = size * 16;
+  table->aused = 0;
+  table->garbage = 0;
+  table->arena = (char*)malloc(table->asize);
+  table->size = size;
+  table->used = 0;
+  table->pinned = 0;
+  table->limit = SYMBOL_LIMIT_MIN;
+  table->gensyms = 0;
+  table->free_ids = (id_stack_t){NULL, 0, 0};
+  table->names = (uint64_t*)malloc(sizeof(uint64_t) * size);
+  table->hashes = (uint64_t*)malloc(sizeof(uint64_t) * size);
+  table->flags = (uint8_t*)malloc(size);
+  table->marks = (bool*)calloc(size, sizeof(bool));
+  table->nslots = 16;
+  while(table->nslots < size * 2) {
+    table->nslots *= 2;
+  }
+  table->slots = (uint64_t*)calloc(table->nslots, sizeof(uint64_t));
+  return table;
+}
+
+void free_symbol_table(symbol_table_t *table) {
+  free(table->arena);
+  free(table->names);
+  free(table->hashes);
+  free(table->flags);
+  free(table->marks);
+  free(table->free_ids.ids);
+  free(table->slots);
+  free(table);
+}
+
+/* FNV-1a. */
+uint64_t symbol_hash(const char *name, size_t len) {
+  uint64_t h = 0xcbf29ce484222325;
+  for(size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)name[i]) * 0x100000001b3;
+  }
+  return h;
+}
+
+char* symbol_name(symbol_table_t *table, uint64_t id) {
+  return table->arena + table->names[id];
+}
+
+/* The slot holding the id of the symbol called the len characters at
+   name, or the empty slot where it would go. */
+uint64_t* symbol_slot(symbol_table_t *table, const char *name, size_t len,
+                      uint64_t h) {
+  uint64_t mask = table->nslots - 1;
+  for(uint64_t i = h & mask;; i = (i + 1) & mask) {
+    uint64_t id = table->slots[i];
+    if(id == 0 || (table->hashes[id - 1] == h &&
+                   strncmp(symbol_name(table, id - 1), name, len) == 0 &&
+                   symbol_name(table, id - 1)[len] == '\0')) {
+      return &table->slots[i];
+    }
+  }
+}
+
+/* Fills slots of nslots from the interned symbols. */
+void fill_symbol_slots(symbol_table_t *table, uint64_t nslots) {
+  free(table->slots);
+  table->nslots = nslots;
+  table->slots = (uint64_t*)calloc(table->nslots, sizeof(uint64_t));
+  uint64_t mask = table->nslots - 1;
+  for(uint64_t id = 0; id < table->used; id++) {
+    if(table->flags[id] != 0) {
+      continue;
+    }
+    uint64_t i = table->hashes[id] & mask;
+    while(table->slots[i] != 0) {
+      i = (i + 1) & mask;
+    }
+    table->slots[i] = id + 1;
+  }
+}
+
+/* A new symbol id with a copy of the len characters at name, marked if
+   a collection is in progress since that collection would not otherwise
+   see it. */
+uint64_t new_symbol(symbol_table_t *table, const char *name, size_t len,
+                    uint64_t h, uint8_t flags);
+
+/* The id of the symbol called the len characters at name, which need
+   not be nul-terminated, interning it first if needed. */
+uint64_t intern(symbol_table_t *table, const char *name, size_t len) {
+  uint64_t h = symbol_hash(name, len);
+  uint64_t *slot = symbol_slot(table, name, len, h);
+  if(*slot != 0) {
+    return *slot - 1;
   }
-  free(vector->elements);
-  free(vector);
+  uint64_t id = new_symbol(table, name, len, h, 0);
+  *slot = id + 1;
+  if((table->used - table->free_ids.used) * 2 > table->nslots) {
+    fill_symbol_slots(table, table->nslots * 2);
+  }
+  return id;
+}
+
+uint64_t live_symbols(symbol_table_t *table) {
+  return table->used - table->free_ids.used;
+}
+
+void unmark_symbols(symbol_table_t *table) {
+  memset(table->marks, 0, table->used * sizeof(bool));
 }
 
-uint64_t insert(vector_t *vector, void *element) {
-  if (vector->used >= vector->size) {
-    vector->size++;
-    vector->size *= 1.25;
-    vector->elements = (void**)realloc(vector->elements, vector->size * sizeof(void*));
+/* Frees every unpinned symbol that the collection left unmarked. */
+void sweep_symbols(symbol_table_t *table) {
+  uint64_t freed = 0;
+  for(uint64_t id = table->pinned; id < table->used; id++) {
+    if(!table->marks[id] && !(table->flags[id] & SYMBOL_FREE)) {
+      table->flags[id] = SYMBOL_FREE;
+      table->garbage += strlen(symbol_name(table, id)) + 1;
+      push_id(&table->free_ids, id);
+      freed++;
+    }
+  }
+  table->limit = 2 * live_symbols(table);
+  if(table->limit < SYMBOL_LIMIT_MIN) {
+    table->limit = SYMBOL_LIMIT_MIN;
+  }
+  if(freed == 0) {
+    return;
+  }
+  fill_symbol_slots(table, table->nslots);
+  if(table->garbage * 2 > table->aused) {
+    char *arena = (char*)malloc(table->asize);
+    uint64_t aused = 0;
+    for(uint64_t id = 0; id < table->used; id++) {
+      if(!(table->flags[id] & SYMBOL_FREE)) {
+        size_t len = strlen(symbol_name(table, id)) + 1;
+        memcpy(arena + aused, symbol_name(table, id), len);
+        table->names[id] = aused;
+        aused += len;
+      }
+    }
+    free(table->arena);
+    table->arena = arena;
+    table->aused = aused;
+    table->garbage = 0;
   }
-  vector->elements[vector->used] = element;
-  return vector->used++; 
 }
 
 char* result_cat(char **res) {
@@ -88,12 +270,27 @@ const typed_pointer FIXNUM     = {.i = 0xFFF1000000000000};
 const typed_pointer SYMBOL     = {.i = 0xFFF2000000000000};
 const typed_pointer PAIR       = {.i = 0xFFF3000000000000};
 const typed_pointer PRIMITIVE  = {.i = 0xFFF4000000000000};
+const typed_pointer FORWARD    = {.i = 0xFFF5000000000000};
+const typed_pointer OBJECT     = {.i = 0xFFF6000000000000};
+const typed_pointer HEADER     = {.i = 0xFFF7000000000000};
+const typed_pointer LINK       = {.i = 0xFFF9000000000000};
+const typed_pointer MOVED      = {.i = 0xFFFA000000000000};
+const typed_pointer LOCAL      = {.i = 0xFFFB000000000000};
 
 typed_pointer make_(typed_pointer type, uint64_t val) {
   typed_pointer res = {.i = type.i | (VALUE_MASK.i & val)};
   return res;
 }
 
+/* A FIXNUM holds a 48-bit two's complement integer; integers outside
+   [FIXNUM_MIN, FIXNUM_MAX] are bignums. */
+#define FIXNUM_MAX (((int64_t)1 << 47) - 1)
+#define FIXNUM_MIN (-((int64_t)1 << 47))
+
+int64_t fixnum_value(typed_pointer e) {
+  return (int64_t)(e.i << 16) >> 16;
+}
+
 bool is_float(typed_pointer tp) {
   return !isnan(tp.f);
 }
@@ -106,65 +303,376 @@ bool eq(typed_pointer t1, typed_pointer t2) {
   return t1.i == t2.i;
 }
 
+/* Objects other than pairs start with a HEADER element holding their
+   kind and their size in elements, followed by that many elements; an
+   OBJECT pointer holds the index of the header. Objects of at least
+   LARGE_OBJECT_SIZE elements are allocated one by one outside the heap
+   block and never move: their pointers have the LARGE_OBJECT bit set
+   and index heap->large. Collections mark large objects instead of
+   copying them and free the ones left unmarked. The elements of the
+   kinds from F64VECTOR_OBJECT on are raw doubles or 64-bit integers
+   rather than typed pointers: collections move them as opaque blobs and
+   never scan them. A bytevector is always a large object holding the
+   address and length of a read-only file mapping, which is unmapped
+   when the object is freed. A bignum holds its sign, 0 or 1, followed
+   by the 64-bit limbs of its magnitude, least significant first. */
+enum {
+  VECTOR_OBJECT,
+  RECORD_OBJECT,
+  CLOSURE_OBJECT,
+  FRAME_OBJECT,
+  CODE_OBJECT,
+  HASH_TABLE_OBJECT,
+  F64VECTOR_OBJECT,
+  I64VECTOR_OBJECT,
+  BYTEVECTOR_OBJECT,
+  BIGNUM_OBJECT
+};
+
+#define LARGE_OBJECT ((uint64_t)1 << 47)
+#define LARGE_OBJECT_SIZE 1024
+
+typed_pointer make_header(uint64_t kind, uint64_t size) {
+  return make_(HEADER, kind << 40 | size);
+}
+
+uint64_t header_kind(typed_pointer header) {
+  return (header.i & VALUE_MASK.i) >> 40;
+}
+
+uint64_t header_size(typed_pointer header) {
+  return header.i & (((uint64_t)1 << 40) - 1);
+}
+
+/* How many elements after e a scan of the heap skips: the elements of
+   a packed vector when e is its header. */
+uint64_t unscanned_elements(typed_pointer e) {
+  return is_(HEADER, e) && header_kind(e) >= F64VECTOR_OBJECT ?
+    header_size(e) : 0;
+}
+
+typedef struct large_object_t {
+  typed_pointer *slots;
+  bool marked;
+  bool dirty;
+} large_object_t;
+
+void free_large(large_object_t *l) {
+  if(l->slots != NULL && header_kind(l->slots[0]) == BYTEVECTOR_OBJECT &&
+     l->slots[2].i > 0) {
+    munmap((void*)l->slots[1].i, l->slots[2].i);
+  }
+  free(l->slots);
+  l->slots = NULL;
+}
+
+/* The heap is one block holding the nursery, [0, nsize), followed by
+   both semispaces, [nsize, nsize+esize) and [nsize+esize, nsize+2*esize).
+   Pair indices are absolute offsets into the block so they stay valid
+   when the block is reallocated to grow or shrink; after growing, the
+   live data of the current semispace starts at sstart rather than at
+   its beginning. New pairs are
+   allocated in the nursery and promoted into the current semispace by
+   minor collections; old pairs pointing into the nursery are recorded
+   in the remembered set by set_car/set_cdr. A heap without a nursery
+   allocates straight into the semispace.
+
+   With a non-zero slice (at least 4) a heap without a nursery collects
+   incrementally: the flip only moves the roots, and every allocated
+   pair then scans at most slice elements of the new semispace. Pairs in
+   the condemned range [clo, chi) have not been copied yet; car/cdr
+   forward any such pointer they read, so the mutator never sees one.
+
+   A compacting heap has a single space, [0, esize), and no nursery. Its
+   collections mark the live pairs and slide them down in place.
+
+   Large objects live outside the block in heap->large and count as old.
+   Those written with a nursery pointer are kept on the dirty list for
+   minor collections, and those marked but not yet scanned by a full or
+   incremental collection on the gray list. A full collection is forced
+   when their total size outgrows llimit.
+
+   In large-heap mode the block is mapped rather than malloc'd: see
+   map_heap.
+
+   Global variables live in globals, indexed by symbol id, with
+   #VAR-NOT-FOUND# in the slots of unbound ids. Full and incremental
+   collections treat the table as roots and mark the symbols bound in
+   it, so a global keeps its id for as long as the heap lives. The ids
+   of globals given a nursery pointer since the last collection are kept
+   on gdirty, and a minor collection scans only those. */
 typedef struct heap_t {
   typed_pointer *elements;
-  typed_pointer *old_elements;
+  uint64_t mapped;
+  uint64_t page_size;
   uint64_t esize;
+  uint64_t emin;
+  uint64_t emax;
+  bool compact;
+  uint64_t space;
+  uint64_t sstart;
   uint64_t eused;
+  uint64_t nsize;
+  uint64_t nused;
+  uint64_t clo;
+  uint64_t chi;
+  uint64_t slice;
+  uint64_t scan;
+  bool collecting;
+  uint64_t threads;
+  uint64_t cells;
+  uint64_t *remembered;
+  uint64_t msize;
+  uint64_t mused;
+  uint64_t collections;
+  uint64_t minor_collections;
+  double gc_time;
+  double minor_gc_time;
+  double max_pause;
+  uint64_t pauses[32];
   typed_pointer *gc_roots;
   uint64_t rsize;
   uint64_t rused;
+  typed_pointer *globals;
+  uint64_t gsize;
+  large_object_t *large;
+  uint64_t lsize;
+  uint64_t lused;
+  uint64_t lelems;
+  uint64_t llimit;
+  id_stack_t lgray;
+  id_stack_t ldirty;
+  id_stack_t gdirty;
+  id_stack_t scopes;
 } heap_t;
 
-heap_t* make_heap(uint64_t nelems, uint64_t nroots) {
+heap_t* make_heap(uint64_t nelems, uint64_t max_elems, uint64_t nursery,
+                  bool compact, uint64_t nroots) {
   heap_t *h = (heap_t*)malloc(sizeof(heap_t));
   h->esize = nelems;
-  h->eused = 0;
-  h->elements = (typed_pointer*)malloc(sizeof(typed_pointer) * nelems);
-  h->old_elements = (typed_pointer*)malloc(sizeof(typed_pointer) * nelems);
+  h->emin = nelems;
+  h->emax = max_elems < nelems ? nelems : max_elems;
+  h->compact = compact;
+  h->nsize = compact ? 0 : nursery;
+  h->nused = 0;
+  h->space = h->nsize;
+  h->sstart = h->nsize;
+  h->eused = h->nsize;
+  h->clo = 0;
+  h->chi = 0;
+  h->slice = 0;
+  h->scan = 0;
+  h->collecting = false;
+  h->threads = 1;
+  h->cells = 0;
+  h->mapped = 0;
+  h->page_size = 0;
+  h->elements = (typed_pointer*)malloc(sizeof(typed_pointer) *
+                                       (h->nsize + (compact ? 1 : 2) * nelems));
+  h->msize = 64;
+  h->mused = 0;
+  h->remembered = (uint64_t*)malloc(sizeof(uint64_t) * h->msize);
+  h->collections = 0;
+  h->minor_collections = 0;
+  h->gc_time = 0;
+  h->minor_gc_time = 0;
+  h->max_pause = 0;
+  memset(h->pauses, 0, sizeof(h->pauses));
   h->rsize = nroots;
   h->rused = 0;
   h->gc_roots = (typed_pointer*)malloc(sizeof(typed_pointer) * nroots);
+  h->globals = NULL;
+  h->gsize = 0;
+  h->large = NULL;
+  h->lsize = 0;
+  h->lused = 0;
+  h->lelems = 0;
+  h->llimit = 16 * LARGE_OBJECT_SIZE;
+  h->lgray = (id_stack_t){NULL, 0, 0};
+  h->ldirty = (id_stack_t){NULL, 0, 0};
+  h->gdirty = (id_stack_t){NULL, 0, 0};
+  h->scopes = (id_stack_t){NULL, 0, 0};
   return h;
 }
 
+enum {
+  NO_HUGE_PAGES,
+  TRANSPARENT_HUGE_PAGES,
+  EXPLICIT_HUGE_PAGES
+};
+
+#define HUGE_PAGE_SIZE ((uint64_t)2 << 20)
+
+/* Large-heap mode: replaces the block of a fresh heap with a mapping
+   that reserves address space for emax, so that resizing never copies
+   the heap and indices can use all 47 bits below LARGE_OBJECT. Pages
+   are only committed when first touched, and release_pages gives them
+   back once a collection has emptied them. Transparent huge pages are
+   requested with madvise; explicit ones come from the hugetlb pool and
+   are reserved up front, so the mapping fails if the pool is too
+   small. Returns false, leaving the heap as it was, if mmap fails. */
+bool map_heap(heap_t *h, int huge_pages) {
+  uint64_t spaces = h->compact ? 1 : 2;
+  if(h->nsize + spaces * h->emax > LARGE_OBJECT) {
+    h->emax = (LARGE_OBJECT - h->nsize) / spaces;
+  }
+  uint64_t page = huge_pages == EXPLICIT_HUGE_PAGES ?
+    HUGE_PAGE_SIZE : (uint64_t)sysconf(_SC_PAGESIZE);
+  uint64_t bytes = sizeof(typed_pointer) * (h->nsize + spaces * h->emax);
+  bytes = (bytes + page - 1) / page * page;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  flags |= huge_pages == EXPLICIT_HUGE_PAGES ? MAP_HUGETLB : MAP_NORESERVE;
+  void *block = mmap(NULL, bytes, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if(block == MAP_FAILED) {
+    return false;
+  }
+  if(huge_pages == TRANSPARENT_HUGE_PAGES) {
+    madvise(block, bytes, MADV_HUGEPAGE);
+  }
+  free(h->elements);
+  h->elements = (typed_pointer*)block;
+  h->mapped = bytes;
+  h->page_size = page;
+  return true;
+}
+
+void stop_gc_workers();
+
 void free_heap(heap_t *heap) {
-  free(heap->elements);
-  free(heap->old_elements);
+  stop_gc_workers();
+  if(heap->mapped > 0) {
+    munmap(heap->elements, heap->mapped);
+  } else {
+    free(heap->elements);
+  }
+  free(heap->remembered);
   free(heap->gc_roots);
+  free(heap->globals);
+  for(uint64_t i = 0; i < heap->lused; i++) {
+    free_large(&heap->large[i]);
+  }
+  free(heap->large);
+  free(heap->lgray.ids);
+  free(heap->ldirty.ids);
+  free(heap->gdirty.ids);
+  free(heap->scopes.ids);
   free(heap);
 }
 
-vector_t *symbols;
+symbol_table_t *symbols;
 heap_t *heap;
-typed_pointer broken_heart, var_not_found, op_not_found,
+typed_pointer var_not_found, op_not_found, wrong_arity, wrong_type, io_error,
   empty_list, false_symbol, true_symbol, lambda_symbol, set_symbol,
   define_symbol, if_symbol, procedure_symbol, quote_symbol,
-  primitive_cons, primitive_add, primitive_eq, primitive_sub, primitive_mult;
+  lexical_lambda_symbol,
+  record_symbol, primitive_cons, primitive_add, primitive_eq, primitive_sub,
+  primitive_mult, primitive_make_vector, primitive_vector_ref,
+  primitive_vector_set, primitive_vector_length, primitive_gensym,
+  primitive_equal, empty_slot, deleted_slot;
 
-typed_pointer insert_symbol(char *symbol) {
-  for(uint64_t i = 0; i < symbols->used; i++){
-    if(strcmp(symbol, symbols->elements[i]) == 0){
-      return make_(SYMBOL, i);
+uint64_t new_symbol(symbol_table_t *table, const char *name, size_t len,
+                    uint64_t h, uint8_t flags) {
+  uint64_t id;
+  if(table->free_ids.used > 0) {
+    id = table->free_ids.ids[--table->free_ids.used];
+  } else {
+    if(table->used >= table->size) {
+      table->size *= 2;
+      table->names = (uint64_t*)realloc(table->names,
+                                        sizeof(uint64_t) * table->size);
+      table->hashes = (uint64_t*)realloc(table->hashes,
+                                         sizeof(uint64_t) * table->size);
+      table->flags = (uint8_t*)realloc(table->flags, table->size);
+      table->marks = (bool*)realloc(table->marks,
+                                    sizeof(bool) * table->size);
     }
+    id = table->used++;
+  }
+  while(table->aused + len + 1 > table->asize) {
+    table->asize *= 2;
+    table->arena = (char*)realloc(table->arena, table->asize);
+  }
+  memcpy(table->arena + table->aused, name, len);
+  table->arena[table->aused + len] = '\0';
+  table->names[id] = table->aused;
+  table->aused += len + 1;
+  table->hashes[id] = h;
+  table->flags[id] = flags;
+  table->marks[id] = heap->collecting;
+  return id;
+}
+
+typed_pointer insert_symbol(char *symbol) {
+  return make_(SYMBOL, intern(symbols, symbol, strlen(symbol)));
+}
+
+/* A fresh uninterned symbol. */
+typed_pointer gensym() {
+  char name[32];
+  snprintf(name, sizeof(name), "g%lu", ++symbols->gensyms);
+  return make_(SYMBOL, new_symbol(symbols, name, strlen(name), 0,
+                                  SYMBOL_UNINTERNED));
+}
+
+/* Collections call this for every symbol they reach. Parallel workers
+   may mark the same symbol at once, which is harmless. */
+void mark_symbol(typed_pointer s) {
+  __atomic_store_n(&symbols->marks[s.i & VALUE_MASK.i], true,
+                   __ATOMIC_RELAXED);
+}
+
+/* An incremental collection never scans what the mutator allocates
+   during it, so a symbol is marked as soon as it is stored anywhere. */
+void symbol_barrier(typed_pointer e) {
+  if(heap->collecting && is_(SYMBOL, e)) {
+    mark_symbol(e);
   }
-  char *s = calloc(strlen(symbol)+1, sizeof(char));
-  strcpy(s, symbol);
-  return make_(SYMBOL, insert(symbols, s));
 }
 
-typed_pointer read_atom(char *token) {
-  char *end = "";
+typed_pointer make_integer(int64_t v);
+typed_pointer read_integer(const char *token, uint64_t len);
+
+/* The atom of the len characters at token, which need not be
+   nul-terminated. Decimal integers are parsed in place, fixnums when
+   they fit and bignums otherwise, however many digits they have. Other
+   tokens that may be numbers are copied out for strtoll and strtod,
+   and the rest are interned. */
+typed_pointer read_atom(const char *token, uint64_t len) {
+  const char *digits = token + (len > 1 && (token[0] == '-' ||
+                                            token[0] == '+'));
+  uint64_t ndigits = len - (digits - token), k = 0;
+  while(k < ndigits && isdigit((unsigned char)digits[k])) {
+    k++;
+  }
+  if(k == ndigits && (digits[0] != '0' || ndigits == 1)) {
+    if(ndigits >= 15) {
+      return read_integer(token, len);
+    }
+    int64_t x = 0;
+    for(k = 0; k < ndigits; k++) {
+      x = x * 10 + (digits[k] - '0');
+    }
+    return make_(FIXNUM, (uint64_t)(token[0] == '-' ? -x : x));
+  } else if(strchr("+-.0123456789iInN", token[0]) == NULL) {
+    return make_(SYMBOL, intern(symbols, token, len));
+  }
+  char small[64], *s = len < sizeof(small) ? small : malloc(len + 1), *end;
+  memcpy(s, token, len);
+  s[len] = '\0';
   typed_pointer res;
   errno = 0;
-  res = make_(FIXNUM, strtoll(token, &end, 0));
-  if (strlen(end) > 0 || errno == ERANGE) {
+  long long x = strtoll(s, &end, 0);
+  res = make_(FIXNUM, (uint64_t)x);
+  if(*end != '\0' || errno == ERANGE || x < FIXNUM_MIN || x > FIXNUM_MAX) {
     errno = 0;
-    res.f = strtod(token, &end);
-    if((strlen(end) > 0 || errno == ERANGE)) {
-      return insert_symbol(token);
+    res.f = strtod(s, &end);
+    if(*end != '\0' || errno == ERANGE) {
+      res = make_(SYMBOL, intern(symbols, token, len));
     }
   }
+  if(s != small) {
+    free(s);
+  }
   return res;
 }
 
@@ -176,731 +684,5337 @@ uint64_t atom_end(char* s, uint64_t start) {
   return end;
 }
 
-typed_pointer make_pair() {
-  assert(heap->eused+2 < heap->esize);
-  heap->eused++;
-  return make_(PAIR, heap->eused++);
+uint64_t space_end() {
+  return heap->space + heap->esize;
 }
 
-typed_pointer car(typed_pointer p) {
-  assert(is_(PAIR, p));
-  return heap->elements[p.i & VALUE_MASK.i];
+bool has_room(uint64_t nelems) {
+  return heap->eused + nelems <= space_end();
 }
 
-void set_car(typed_pointer pair, typed_pointer e) {
-  assert(is_(PAIR, pair));
-  heap->elements[(int32_t)pair.i] = e;
+/* With slice elements scanned per pair allocated, an incremental
+   collection started before the semispace is more than (slice-2)/slice
+   full finishes before the new semispace fills up. Past that point the
+   heap is collected all at once. */
+uint64_t incremental_limit() {
+  uint64_t headroom = (heap->esize * 2 + heap->slice - 1) / heap->slice + 2;
+  uint64_t limit = heap->sstart + heap->esize - headroom;
+  return limit < space_end() ? limit : space_end();
 }
 
-void set_car_old(typed_pointer pair, typed_pointer e) {
-  assert(is_(PAIR, pair));
-  heap->old_elements[(int32_t)pair.i] = e;
+/* Where the mutator has to stop allocating in the semispace. */
+uint64_t allocation_end() {
+  if(heap->slice > 0 && !heap->collecting &&
+     heap->eused <= incremental_limit()) {
+    return incremental_limit();
+  }
+  return space_end();
 }
 
-typed_pointer cdr(typed_pointer p) {
-  assert(is_(PAIR, p));
-  return heap->elements[(p.i & VALUE_MASK.i) - 1];
+bool nursery_has_room(uint64_t nelems) {
+  return heap->nused + nelems <= heap->nsize;
 }
 
-void set_cdr(typed_pointer pair, typed_pointer e) {
-  assert(is_(PAIR, pair));
-  heap->elements[(int32_t)pair.i - 1] = e;
+/* Collections copy proper lists as runs of cells: each cell is a single
+   element holding its car, its cdr being the next cell, and the run ends
+   with a LINK element holding the cdr of the last cell, () or a pair. A
+   pointer to a cell is a PAIR with the CDR_CODED bit set. set_cdr
+   cannot store into a cell, so it replaces the cell with an ordinary
+   pair and leaves a MOVED pointer to that pair in its element.
+   heap->cells counts the cells copied since the last flip. */
+#define CDR_CODED ((uint64_t)1 << 47)
+#define CDR_RUN_MIN 8
+#define CDR_RUN_MAX 256
+
+bool is_cell(typed_pointer p) {
+  return is_(PAIR, p) && (p.i & CDR_CODED) != 0;
 }
 
-void set_cdr_old(typed_pointer pair, typed_pointer e) {
-  assert(is_(PAIR, pair));
-  heap->old_elements[(int32_t)pair.i - 1] = e;
+/* The index of the car of a pair or cell. */
+uint64_t pair_index(typed_pointer p) {
+  return p.i & VALUE_MASK.i & ~CDR_CODED;
 }
 
-typed_pointer car_old(typed_pointer p) {
-  assert(is_(PAIR, p));
-  return heap->old_elements[p.i & VALUE_MASK.i];
+typed_pointer make_cell(uint64_t i) {
+  return make_(PAIR, CDR_CODED | i);
 }
 
-typed_pointer cdr_old(typed_pointer p) {
-  assert(is_(PAIR, p));
-  return heap->old_elements[(p.i & VALUE_MASK.i) - 1];
+typed_pointer make_link(typed_pointer tail) {
+  return make_(LINK, is_(PAIR, tail) ? tail.i : 0);
 }
 
-typed_pointer rellocate_pair(typed_pointer p) {
-  typed_pointer old_car=car_old(p), old_cdr=cdr_old(p),
-    new_pair, tmp;
-  if(eq(broken_heart, old_car)) {
-    return old_cdr;
-  }
-  uint64_t scan = heap->eused;
-  new_pair = make_pair();
-    
-  set_car(new_pair, old_car);
-  set_cdr(new_pair, old_cdr);
+typed_pointer link_tail(typed_pointer link) {
+  return (link.i & VALUE_MASK.i) == 0 ? empty_list : make_(PAIR, link.i);
+}
 
-  set_car_old(p, broken_heart);
-  set_cdr_old(p, new_pair);
-  
-  while(scan < heap->eused) {
-    if(is_(PAIR, heap->elements[scan])) {
-      if(eq(broken_heart, car_old(heap->elements[scan]))) {
-	heap->elements[scan] = cdr_old(heap->elements[scan]);
-      } else {
-	// copy old pair
-	tmp = make_pair();
-	set_car(tmp, car_old(heap->elements[scan]));
-	set_cdr(tmp, cdr_old(heap->elements[scan]));
-
-	//set redirect address
-	set_car_old(heap->elements[scan], broken_heart);
-	set_cdr_old(heap->elements[scan], tmp);
-	
-	heap->elements[scan] = tmp;
-      }
-    }
-    scan++;
+/* The pointer held by a LINK or MOVED element, or e itself. */
+typed_pointer unwrap(typed_pointer e) {
+  if(is_(LINK, e)) {
+    return link_tail(e);
+  } else if(is_(MOVED, e)) {
+    return make_(PAIR, e.i);
   }
-    
-  return new_pair;
+  return e;
 }
 
-typed_pointer rellocate_root(typed_pointer root) {
-  if(is_(PAIR, root)) {
-    return rellocate_pair(root);
-  } else {
-    return root;
-  }
+bool is_young(typed_pointer p) {
+  return (is_(PAIR, p) || is_(OBJECT, p)) && (p.i & VALUE_MASK.i) < heap->nsize;
 }
 
-void gc() {
-  typed_pointer *tmp;
-  tmp = heap->elements;
-  heap->elements = heap->old_elements;
-  heap->old_elements = tmp;
-  heap->eused = 0;
-  
-  for(int i = 0; i < heap->rused; i++){
-    heap->gc_roots[i] = rellocate_root(heap->gc_roots[i]);
-  }
+typed_pointer make_pair() {
+  assert(has_room(2));
+  heap->eused++;
+  return make_(PAIR, heap->eused++);
 }
 
-void push_root(typed_pointer root) {
-  assert(heap->rused+1 < heap->rsize);
-  heap->gc_roots[heap->rused++] = root; 
+typed_pointer make_young_pair() {
+  assert(nursery_has_room(2));
+  heap->nused++;
+  return make_(PAIR, heap->nused++);
 }
 
-typed_pointer pop_root() {
-  assert(heap->rused-1 >= 0 && heap->rused-1 < heap->rsize);
-  return heap->gc_roots[--(heap->rused)];
+void remember(uint64_t slot) {
+  if(heap->mused > 0 && heap->remembered[heap->mused-1] == slot) {
+    return;
+  }
+  if(heap->mused >= heap->msize) {
+    heap->msize *= 2;
+    heap->remembered = (uint64_t*)realloc(heap->remembered,
+                                          sizeof(uint64_t) * heap->msize);
+  }
+  heap->remembered[heap->mused++] = slot;
 }
 
-typed_pointer peek_root() {
-  return heap->gc_roots[heap->rused-1];
+bool is_large(typed_pointer p) {
+  return is_(OBJECT, p) && (p.i & LARGE_OBJECT) != 0;
 }
 
-typed_pointer cons(typed_pointer tcar, typed_pointer tcdr) {
-  push_root(tcar);
-  push_root(tcdr);
-  gc();
-  tcdr = pop_root();
-  tcar = pop_root();
-  typed_pointer new_pair = make_pair();
-  set_car(new_pair, tcar);
-  set_cdr(new_pair, tcdr);
-  return new_pair;
+large_object_t* large_object(typed_pointer p) {
+  return &heap->large[p.i & VALUE_MASK.i & ~LARGE_OBJECT];
 }
 
-char* get_token(char **ps) {
-  while(isspace(*ps[0])) {
-    (*ps)++;
-  }
-  
-  if(*ps[0] == '\0') {
-    return NULL;
-  } else if(*ps[0] == '(') {
-    (*ps)++;
-    char *token = calloc(2, sizeof(char));
-    token[0] = '(';
-    return token;
-  } else if(*ps[0] == ')') {
-    (*ps)++;
-    char *token = calloc(2, sizeof(char));
-    token[0] = ')';
-    return token;
-  } else {
-    char *start = *ps;
-    while(!isspace(*ps[0]) && *ps[0] != '\0' && *ps[0] != '(' && *ps[0] != ')') {
-      (*ps)++;
-    }
-    char *token = calloc(*ps - start + 1, sizeof(char));
-    memcpy(token, start, *ps - start);
-    return token;
-  }
-}
-
-typed_pointer read_list(char **s) {
-  char *token = get_token(s);
-  assert(token != NULL);
-  typed_pointer res;
-  if(strcmp(token, ")") == 0) {
-    res = empty_list;
-  } else if(strcmp(token, "(") == 0) {
-    typed_pointer t1 = read_list(s);
-    push_root(t1);
-    typed_pointer t2 = read_list(s);
-    res = cons(pop_root(), t2);
-  } else {
-    res = cons(read_atom(token), read_list(s));
+typed_pointer rellocate_root(typed_pointer root);
+
+bool is_condemned(typed_pointer p) {
+  p = unwrap(p);
+  uint64_t i = is_(PAIR, p) ? pair_index(p) : p.i & VALUE_MASK.i;
+  if(is_large(p)) {
+    return !large_object(p)->marked;
   }
-  free(token);
-  return res;
+  return (is_(PAIR, p) || is_(OBJECT, p)) && i >= heap->clo && i < heap->chi;
 }
 
-typed_pointer read_sexp(char *s) {
-  char *token = get_token(&s);
-  assert(token != NULL && strcmp(token, ")") != 0);
-  typed_pointer res;
-  if(strcmp(token, "(") == 0) {
-    res = read_list(&s);
-  } else {
-    res = read_atom(token);
+typed_pointer forward_slot(typed_pointer *slot) {
+  typed_pointer e = *slot;
+  if(is_condemned(e)) {
+    e = rellocate_root(e);
+    *slot = e;
   }
-  free(token);
-  return res;
+  return e;
 }
 
-char* atom_to_str(typed_pointer atom) {
-  char *res;
-  int size;
-  if(is_(FIXNUM, atom)) {
-    size = snprintf(NULL, 0, "%d", (int32_t)atom.i);
-    res = calloc(size+1, sizeof(char));
-    size = snprintf(res, size+1, "%d", (int32_t)atom.i);
-    return res;
-  } else if(is_(SYMBOL, atom)){
-    char *s = symbols->elements[atom.i & VALUE_MASK.i];
-    char *res = calloc(strlen(s)+1, sizeof(char));
-    strcpy(res, s);
-    return res;
-  } else if(is_(PRIMITIVE, atom)){
-    size = snprintf(NULL, 0, "#PRIMITIVE#%d#", (int32_t)atom.i);
-    res = calloc(size+1, sizeof(char));
-    size = snprintf(res, size+1, "#PRIMITIVE#%d#", (int32_t)atom.i);
-    return res;
-  } else {
-    size = snprintf(NULL, 0, "%f", atom.f);
-    res = calloc(size+1, sizeof(char));
-    size = snprintf(res, size+1, "%f", atom.f);
-    return res;
-  }
+/* Only an incremental collection in progress has to forward what the
+   mutator reads; the check is kept small enough to be inlined. */
+static inline typed_pointer read_barrier(typed_pointer *slot) {
+  return heap->collecting ? forward_slot(slot) : *slot;
 }
 
-uint64_t pused = 0;
-uint64_t psize = 1024;
-typed_pointer parents[1024];
+/* Follows moved cells to the pair that now holds their car and cdr. */
+typed_pointer resolve(typed_pointer p) {
+  while(is_cell(p)) {
+    typed_pointer e = read_barrier(&heap->elements[pair_index(p)]);
+    if(!is_(MOVED, e)) {
+      break;
+    }
+    p = make_(PAIR, e.i);
+  }
+  return p;
+}
 
-void push(typed_pointer p) {
-  assert(pused < psize);
-  parents[pused++] = p;
+/* Only the element of a cell can hold a MOVED pointer. */
+typed_pointer car(typed_pointer p) {
+  assert(is_(PAIR, p));
+  typed_pointer e = read_barrier(&heap->elements[pair_index(p)]);
+  return is_(MOVED, e) ? car(make_(PAIR, e.i)) : e;
 }
 
-void pop() {
-  pused--;
+void set_car(typed_pointer pair, typed_pointer e) {
+  assert(is_(PAIR, pair));
+  if(is_cell(pair)) {
+    pair = resolve(pair);
+  }
+  if(is_young(e) && !is_young(pair)) {
+    remember(pair_index(pair));
+  }
+  symbol_barrier(e);
+  heap->elements[pair_index(pair)] = e;
 }
 
-bool contains(typed_pointer p) {
-  for(uint64_t i = 0; i < pused; i++) {
-    if(eq(parents[i], p)) {
-      return true;
-    }
+typed_pointer cdr(typed_pointer p) {
+  assert(is_(PAIR, p));
+  uint64_t i = pair_index(p);
+  if(!is_cell(p)) {
+    return read_barrier(&heap->elements[i - 1]);
   }
-  return false;
+  typed_pointer e = read_barrier(&heap->elements[i]);
+  if(is_(MOVED, e)) {
+    return cdr(make_(PAIR, e.i));
+  }
+  typed_pointer next = read_barrier(&heap->elements[i + 1]);
+  return is_(LINK, next) ? link_tail(next) : make_cell(i + 1);
 }
 
-char* pair_to_str(typed_pointer pair) {
-  char *res[5] = {"", "", "", "", ""};
-  char *s;
-  if(contains(pair)) {
-    s = calloc(4, sizeof(char));
-    s[0] = '.';
-    s[1] = '.';
-    s[2] = '.';
-    s[3] = ')';
-    return s;
+void move_cell(typed_pointer cell, typed_pointer e);
+
+/* The last cell of a run keeps its cdr in the LINK after it, which can
+   take any list; every other cell has to be moved. */
+void set_cdr(typed_pointer pair, typed_pointer e) {
+  assert(is_(PAIR, pair));
+  if(is_cell(pair)) {
+    pair = resolve(pair);
   }
-  
-  if(is_(PAIR, car(pair))) {
-    res[0] = "(";
-    push(pair);
-    res[1] = pair_to_str(car(pair));
-    pop();
-  } else {
-    res[1] = atom_to_str(car(pair));
+  uint64_t i = pair_index(pair);
+  if(is_cell(pair) && (!is_(LINK, heap->elements[i + 1]) ||
+                       !(is_(PAIR, e) || eq(e, empty_list)))) {
+    move_cell(pair, e);
+    return;
   }
- 
-  if(is_(PAIR, cdr(pair))) {
-    res[2] = " ";
-    push(pair);
-    res[3] = pair_to_str(cdr(pair));
-    pop();
-    s = result_cat(res);
-    free(res[3]);
-  } else if(eq(cdr(pair), empty_list)) {
-    res[2] = ")";
-    s = result_cat(res);
-  } else {
-    res[2] = " . ";
-    res[3] = atom_to_str(cdr(pair));
-    res[4] = ")";
-    s = result_cat(res);
-    free(res[3]);
+  uint64_t slot = is_cell(pair) ? i + 1 : i - 1;
+  if(is_young(e) && !is_young(pair)) {
+    remember(slot);
   }
-  
-  free(res[1]);
-  return s;
+  symbol_barrier(e);
+  heap->elements[slot] = is_cell(pair) ? make_link(e) : e;
 }
 
-char* sexp_to_str(typed_pointer sexp) {
-  if(is_(PAIR, sexp)) {
-    char *t = pair_to_str(sexp);
-    char *res = calloc(strlen(t) + 2, sizeof(char));
-    strcat(res, "(");
-    strcat(res, t);
-    free(t);
-    return res;
-  } else {
-    return atom_to_str(sexp);
+/* The header of o followed by its elements. */
+typed_pointer* object_slots(typed_pointer o) {
+  if(is_large(o)) {
+    return large_object(o)->slots;
   }
+  return &heap->elements[o.i & VALUE_MASK.i];
 }
 
-/* EVAL */
+uint64_t object_kind(typed_pointer o) {
+  return header_kind(object_slots(o)[0]);
+}
 
-bool is_self_evaluating(typed_pointer exp) {
-  return !is_(PAIR, exp) && !is_(SYMBOL, exp);
+uint64_t object_size(typed_pointer o) {
+  return header_size(object_slots(o)[0]);
 }
 
-bool is_variable(typed_pointer exp) {
-  return is_(SYMBOL, exp) && !eq(exp, empty_list);
+bool is_object(typed_pointer p, uint64_t kind) {
+  return is_(OBJECT, p) && object_kind(p) == kind;
 }
 
-typed_pointer make_frame(typed_pointer vars, typed_pointer vals) {
-  return cons(vars, vals);
+typed_pointer object_ref(typed_pointer o, uint64_t k) {
+  assert(is_(OBJECT, o) && k < object_size(o));
+  return read_barrier(&object_slots(o)[k + 1]);
 }
 
-typed_pointer frame_vars(typed_pointer frame) {
-  return car(frame);
+void object_set(typed_pointer o, uint64_t k, typed_pointer e) {
+  assert(is_(OBJECT, o) && k < object_size(o));
+  if(is_young(e) && !is_young(o)) {
+    if(!is_large(o)) {
+      remember((o.i & VALUE_MASK.i) + k + 1);
+    } else if(!large_object(o)->dirty) {
+      large_object(o)->dirty = true;
+      push_id(&heap->ldirty, o.i & VALUE_MASK.i & ~LARGE_OBJECT);
+    }
+  }
+  symbol_barrier(e);
+  object_slots(o)[k + 1] = e;
 }
 
-typed_pointer frame_vals(typed_pointer frame) {
-  return cdr(frame);
+bool is_packed(typed_pointer p) {
+  return is_object(p, F64VECTOR_OBJECT) || is_object(p, I64VECTOR_OBJECT);
 }
 
-typed_pointer first_frame(typed_pointer env) {
-  return car(env);
+/* Packed vectors hold doubles or 64-bit integers unboxed. Their
+   elements are boxed on the way out, integers as fixnums or bignums and
+   every NaN made the one NaN that is not a tag, and unboxed on the way
+   in from integers or doubles. */
+const typed_pointer packed_nan = {.i = 0x7FF8000000000000};
+
+typed_pointer* packed_elements(typed_pointer vector) {
+  return object_slots(vector) + 1;
 }
 
-typed_pointer enclosing_env(typed_pointer env) {
-  return cdr(env);
+typed_pointer packed_ref(typed_pointer vector, uint64_t k) {
+  assert(k < object_size(vector));
+  typed_pointer e = packed_elements(vector)[k];
+  if(object_kind(vector) == I64VECTOR_OBJECT) {
+    return make_integer((int64_t)e.i);
+  }
+  return isnan(e.f) ? packed_nan : e;
 }
 
-typed_pointer scan(typed_pointer frame, typed_pointer var) {
-  typed_pointer vars = frame_vars(frame), vals = frame_vals(frame);
-  while(!eq(vars, empty_list)) {
-    if(eq(car(vars), var)) {
-      return car(vals);
+/* Stores e unboxed, returning false if it is not a number or is a
+   bignum stored as a 64-bit integer that does not fit one. */
+bool packed_set(typed_pointer vector, uint64_t k, typed_pointer e) {
+  assert(k < object_size(vector));
+  typed_pointer raw;
+  bool f64 = object_kind(vector) == F64VECTOR_OBJECT;
+  if(is_(FIXNUM, e)) {
+    int64_t x = fixnum_value(e);
+    if(f64) {
+      raw.f = (double)x;
+    } else {
+      raw.i = (uint64_t)x;
+    }
+  } else if(is_float(e)) {
+    if(f64) {
+      raw = e;
+    } else {
+      raw.i = (uint64_t)(int64_t)e.f;
     }
-    vars = cdr(vars);
-    vals = cdr(vals);
+  } else if(is_object(e, BIGNUM_OBJECT)) {
+    bool negative = object_slots(e)[1].i;
+    typed_pointer *limbs = object_slots(e) + 2;
+    uint64_t n = object_size(e) - 1;
+    if(f64) {
+      raw.f = 0;
+      for(uint64_t i = n; i-- > 0;) {
+        raw.f = raw.f * 0x1p64 + (double)limbs[i].i;
+      }
+      raw.f = negative ? -raw.f : raw.f;
+    } else if(n == 1 && limbs[0].i <= (uint64_t)INT64_MAX + negative) {
+      raw.i = negative ? -limbs[0].i : limbs[0].i;
+    } else {
+      return false;
+    }
+  } else {
+    return false;
   }
-  return var_not_found;
+  packed_elements(vector)[k] = raw;
+  return true;
 }
 
-typed_pointer lookup_variable_value(typed_pointer var, typed_pointer env) {
-  typed_pointer frame, val = var_not_found;
-  while(!eq(env, empty_list)) {
-    frame = first_frame(env);
-    val = scan(frame, var);
-    if (!eq(val, var_not_found)) {
-      return val;
-    }
-    env = enclosing_env(env);
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The cdr of a pair or cell that has not been copied yet. */
+typed_pointer uncopied_cdr(typed_pointer p) {
+  uint64_t i = pair_index(p);
+  if(!is_cell(p)) {
+    return heap->elements[i - 1];
   }
-  return val;
+  typed_pointer next = heap->elements[i + 1];
+  return is_(LINK, next) ? link_tail(next) : make_cell(i + 1);
 }
 
-bool is_quoted(typed_pointer exp) {
-  return eq(car(exp), quote_symbol);
+/* Whether p can be copied as a cell of a run: it is condemned, not yet
+   copied nor moved, and its cdr can follow it in the run or go in the
+   LINK. */
+bool is_run_cell(typed_pointer p, typed_pointer *next) {
+  uint64_t i = pair_index(p);
+  if(!is_(PAIR, p) || i < heap->clo || i >= heap->chi ||
+     is_(FORWARD, heap->elements[i]) || is_(MOVED, heap->elements[i])) {
+    return false;
+  }
+  *next = uncopied_cdr(p);
+  return is_(PAIR, *next) || eq(*next, empty_list);
 }
 
-typed_pointer text_of_quotation(typed_pointer exp) {
-  return car(cdr(exp));
+/* How many cells a run starting at p would hold, at most max. The count
+   is only an upper bound, since a cyclic or shared list reaches cells
+   that the run will already have copied. Short lists are left as pairs:
+   the code the evaluator walks is mostly made of them, and mixing cells
+   into it costs more in mispredicted branches in cdr than it saves. */
+uint64_t run_length(typed_pointer p, uint64_t max) {
+  uint64_t n = 0;
+  while(n < max && is_run_cell(p, &p)) {
+    n++;
+  }
+  return n;
 }
 
-bool is_assignment(typed_pointer exp) {
-  return eq(car(exp), set_symbol);
+void heap_exhausted();
+
+/* Copies p into the current semispace unless it lies outside the
+   condemned range (the whole heap for a full collection, the nursery for
+   a minor one, the old semispace for an incremental one) or has already
+   been moved, in which case its car holds a FORWARD pointer to the
+   copy. A list is copied as a run of up to CDR_RUN_MAX cells. The
+   collector writes the elements directly so that copying does not go
+   through the barriers. Survivors that do not fit in a semispace that
+   could not grow exhaust the heap. */
+typed_pointer rellocate_pair(typed_pointer p) {
+  uint64_t i = pair_index(p);
+  if(i < heap->clo || i >= heap->chi) {
+    return p;
+  }
+  typed_pointer e = heap->elements[i];
+  if(is_(FORWARD, e)) {
+    return make_(PAIR, e.i);
+  } else if(is_(MOVED, e)) {
+    return rellocate_pair(make_(PAIR, e.i));
+  }
+  uint64_t room = space_end() - heap->eused;
+  uint64_t n = run_length(p, room > CDR_RUN_MAX ? CDR_RUN_MAX :
+                          room > 0 ? room - 1 : 0);
+  if(n < CDR_RUN_MIN) {
+    if(!has_room(2)) {
+      heap_exhausted();
+    }
+    typed_pointer new_pair = make_pair();
+    uint64_t j = pair_index(new_pair);
+    heap->elements[j] = e;
+    heap->elements[j-1] = uncopied_cdr(p);
+    heap->elements[i] = make_(FORWARD, j);
+    return new_pair;
+  }
+  uint64_t start = heap->eused;
+  for(uint64_t k = 0; k < n; k++) {
+    i = pair_index(p);
+    if(is_(FORWARD, heap->elements[i])) {
+      break;
+    }
+    typed_pointer next = uncopied_cdr(p);
+    heap->elements[heap->eused] = heap->elements[i];
+    heap->elements[i] = make_(FORWARD, make_cell(heap->eused).i);
+    heap->eused++;
+    heap->cells++;
+    p = next;
+  }
+  heap->elements[heap->eused++] = make_link(p);
+  return make_cell(start);
 }
 
-typed_pointer assignment_var(typed_pointer exp) {
-  return car(cdr(exp));
+/* Objects are forwarded by overwriting their header with a FORWARD
+   pointer to the copy. A large object is marked and queued on the gray
+   list instead, unless only the nursery is being collected. */
+typed_pointer rellocate_object(typed_pointer o) {
+  uint64_t i = o.i & VALUE_MASK.i;
+  if(is_large(o)) {
+    large_object_t *l = large_object(o);
+    if(heap->chi > heap->nsize && !l->marked) {
+      l->marked = true;
+      push_id(&heap->lgray, i & ~LARGE_OBJECT);
+    }
+    return o;
+  }
+  if(i < heap->clo || i >= heap->chi) {
+    return o;
+  }
+  typed_pointer header = heap->elements[i];
+  if(is_(FORWARD, header)) {
+    return make_(OBJECT, header.i);
+  }
+  uint64_t n = header_size(header) + 1;
+  if(!has_room(n)) {
+    heap_exhausted();
+  }
+  uint64_t j = heap->eused;
+  heap->eused += n;
+  memcpy(&heap->elements[j], &heap->elements[i], sizeof(typed_pointer) * n);
+  heap->elements[i] = make_(FORWARD, j);
+  return make_(OBJECT, j);
 }
 
-typed_pointer assignment_val(typed_pointer exp) {
-  return car(cdr(cdr(exp)));
+typed_pointer rellocate_root(typed_pointer root) {
+  if(is_(PAIR, root)) {
+    return rellocate_pair(root);
+  } else if(is_(OBJECT, root)) {
+    return rellocate_object(root);
+  } else if(is_(LINK, root)) {
+    return make_link(rellocate_root(link_tail(root)));
+  } else if(is_(MOVED, root)) {
+    return make_(MOVED, rellocate_pair(make_(PAIR, root.i)).i);
+  } else if(is_(SYMBOL, root)) {
+    mark_symbol(root);
+  }
+  return root;
 }
 
-typed_pointer set_in_frame(typed_pointer frame, typed_pointer var, typed_pointer val) {
-  typed_pointer vars = frame_vars(frame), vals = frame_vals(frame);
-  while(!eq(vars, empty_list)) {
-    if(eq(car(vars), var)) {
-      set_car(vals, val);
-      return car(vals);
+void mark_globals() {
+  for(uint64_t id = 0; id < heap->gsize; id++) {
+    if(!eq(heap->globals[id], var_not_found)) {
+      mark_symbol(make_(SYMBOL, id));
     }
-    vars = cdr(vars);
-    vals = cdr(vals);
   }
-  return var_not_found;
 }
 
-typed_pointer set_var_val(typed_pointer var, typed_pointer val, typed_pointer env) {
-  typed_pointer frame, old_val;
-  while(!eq(env, empty_list)) {
-    frame = first_frame(env);
-    old_val = set_in_frame(frame, var, val);
-    if (!eq(old_val, var_not_found)) {
-      return val;
+void rellocate_roots() {
+  for(int i = 0; i < heap->rused; i++){
+    heap->gc_roots[i] = rellocate_root(heap->gc_roots[i]);
+  }
+  for(uint64_t id = 0; id < heap->gsize; id++) {
+    heap->globals[id] = rellocate_root(heap->globals[id]);
+  }
+  mark_globals();
+}
+
+/* Scans the elements of large object id, returning how many there were. */
+uint64_t scan_large(uint64_t id) {
+  typed_pointer *slots = heap->large[id].slots;
+  uint64_t n = header_size(slots[0]);
+  for(uint64_t k = 1 + unscanned_elements(slots[0]); k <= n; k++) {
+    slots[k] = rellocate_root(slots[k]);
+  }
+  return n;
+}
+
+void scan_elements(uint64_t scan) {
+  while(scan < heap->eused || heap->lgray.used > 0) {
+    if(scan < heap->eused) {
+      heap->elements[scan] = rellocate_root(heap->elements[scan]);
+      scan += 1 + unscanned_elements(heap->elements[scan]);
+    } else {
+      scan_large(heap->lgray.ids[--heap->lgray.used]);
     }
-    env = enclosing_env(env);
   }
-  
-  return var_not_found;
 }
 
-bool is_definition(typed_pointer exp) {
-  return eq(car(exp), define_symbol);
+/* Frees the large objects left unmarked by a full or incremental
+   collection and unmarks the others. The next collection is forced once
+   the large object space has doubled. */
+void sweep_large() {
+  heap->lelems = 0;
+  for(uint64_t i = 0; i < heap->lused; i++) {
+    large_object_t *l = &heap->large[i];
+    if(l->slots == NULL) {
+      continue;
+    } else if(l->marked) {
+      l->marked = false;
+      heap->lelems += header_size(l->slots[0]) + 1;
+    } else {
+      free_large(l);
+    }
+  }
+  heap->llimit = 2 * heap->lelems;
+  if(heap->llimit < 16 * LARGE_OBJECT_SIZE) {
+    heap->llimit = 16 * LARGE_OBJECT_SIZE;
+  }
 }
 
-typed_pointer def_var(typed_pointer exp) {
-  if(is_(SYMBOL, car(cdr(exp)))) {
-    return car(cdr(exp));
-  } else {
-    return car(car(cdr(exp)));
+void clear_dirty() {
+  for(uint64_t i = 0; i < heap->ldirty.used; i++) {
+    heap->large[heap->ldirty.ids[i]].dirty = false;
   }
+  heap->ldirty.used = 0;
+  heap->gdirty.used = 0;
 }
 
-typed_pointer make_lambda(typed_pointer formals, typed_pointer body) {
-  return cons(lambda_symbol, cons(formals, body));
+/* Pauses are also counted in power of two buckets of microseconds so
+   that print_gc_stats can report percentiles. */
+void record_pause(double start, double *total) {
+  double pause = now() - start;
+  *total += pause;
+  if(pause > heap->max_pause) {
+    heap->max_pause = pause;
+  }
+  uint64_t us = pause * 1e6, bucket = 0;
+  while(us > 0 && bucket < 31) {
+    us >>= 1;
+    bucket++;
+  }
+  heap->pauses[bucket]++;
 }
 
-bool is_lambda(typed_pointer exp) {
-  return eq(car(exp), lambda_symbol);
+/* Number of elements in the heap block for spaces of size elements. */
+uint64_t block_size(uint64_t size) {
+  return heap->nsize + (heap->compact ? 1 : 2) * size;
 }
 
-typed_pointer lambda_parameters(typed_pointer exp) {
-  return car(cdr(exp));
+/* Gives the whole pages of elements [from, to) of a mapped block back to
+   the OS; they read as zeroes when next touched. */
+void release_pages(uint64_t from, uint64_t to) {
+  if(heap->mapped == 0) {
+    return;
+  }
+  uint64_t per_page = heap->page_size / sizeof(typed_pointer);
+  from = (from + per_page - 1) / per_page * per_page;
+  to = to / per_page * per_page;
+  if(from < to) {
+    madvise(&heap->elements[from], (to - from) * sizeof(typed_pointer),
+            MADV_DONTNEED);
+  }
 }
 
-typed_pointer lambda_body(typed_pointer exp) {
-  return cdr(cdr(exp));
+/* Releases the semispace that is not in use after a collection, which
+   is the to-space of the next one. */
+void release_other_space() {
+  uint64_t other = heap->space == heap->nsize ?
+    heap->nsize + heap->esize : heap->nsize;
+  release_pages(other, other + heap->esize);
 }
 
-typed_pointer def_val(typed_pointer exp) {
-  if(is_(SYMBOL, car(cdr(exp)))) {
-    return car(cdr(cdr(exp)));
+/* Resizes the block for spaces of size elements. A mapped block already
+   spans the largest size, so shrinking only releases the pages past its
+   new end. */
+void resize_block(uint64_t size) {
+  if(heap->mapped > 0) {
+    release_pages(block_size(size), block_size(heap->esize));
   } else {
-    return make_lambda(cdr(car(cdr(exp))), cdr(cdr(exp)));
+    heap->elements = (typed_pointer*)realloc(heap->elements,
+                                             sizeof(typed_pointer) *
+                                             block_size(size));
+    assert(heap->elements != NULL);
   }
+  heap->esize = size;
 }
 
-typed_pointer define_var(typed_pointer var, typed_pointer val, typed_pointer env) {
-  typed_pointer frame = first_frame(env);
-  typed_pointer r = set_in_frame(frame, var, val);
-  if(eq(r, var_not_found)) {
-    push_root(val);
-    push_root(frame);
-    
-    typed_pointer vals = cons(val, frame_vals(frame));
-    frame = peek_root();
-    set_cdr(frame, vals);
-    // var is always an atom doesn't need to be saved
-    
-    typed_pointer vars = cons(var, frame_vars(frame));
-    frame = pop_root();
-    set_car(frame, vars);
-    return pop_root();
-  } else {
-    return r;
+/* Grows the semispaces to at least nelems without moving any live
+   data: the current semispace stays where it is and ends up inside the
+   new lower semispace, which always holds when the size at least
+   doubles. Returns whether the semispaces now hold nelems, which they
+   cannot once emax is reached. */
+bool grow_heap(uint64_t nelems) {
+  uint64_t size = heap->esize;
+  while(size < nelems && size < heap->emax) {
+    size *= 2;
+  }
+  if(size > heap->emax) {
+    size = heap->emax;
   }
+  if(size <= heap->esize || heap->eused > heap->nsize + size) {
+    return heap->esize >= nelems;
+  }
+  resize_block(size);
+  heap->space = heap->nsize;
+  return heap->esize >= nelems;
 }
 
-bool is_if(typed_pointer exp) {
-  return eq(car(exp), if_symbol);
+void flip() {
+  heap->space = heap->space == heap->nsize ?
+    heap->nsize + heap->esize : heap->nsize;
+  heap->sstart = heap->space;
+  heap->eused = heap->space;
+  heap->cells = 0;
+  unmark_symbols(symbols);
 }
 
-typed_pointer if_predicate(typed_pointer exp) {
-  return car(cdr(exp));
+void gc_step(uint64_t budget);
+
+/* Mark-compact collection. Live pairs and objects are marked in a
+   bitmap with one bit per element; the new index of a live element is
+   the start of the space plus the number of live elements below it,
+   which the per-word counts make a popcount away. Pointers are updated
+   and the elements slid down in a single pass in address order. */
+uint64_t *marks;
+uint64_t *mark_counts;
+
+bool is_marked(uint64_t i) {
+  return (marks[i / 64] >> (i % 64)) & 1;
 }
 
-typed_pointer if_consequent(typed_pointer exp) {
-  return car(cdr(cdr(exp)));
+void mark_element(uint64_t i) {
+  marks[i / 64] |= (uint64_t)1 << (i % 64);
 }
 
-typed_pointer if_alternative(typed_pointer exp) {
-  return car(cdr(cdr(cdr(exp))));
+uint64_t compacted_index(uint64_t i) {
+  uint64_t below = marks[i / 64] & (((uint64_t)1 << (i % 64)) - 1);
+  return heap->space + mark_counts[i / 64] + __builtin_popcountll(below);
 }
 
-bool is_application(typed_pointer exp) {
-  return is_(PAIR, exp);
+typed_pointer compacted(typed_pointer p) {
+  if(is_(PAIR, p)) {
+    return make_(PAIR, compacted_index(p.i & VALUE_MASK.i));
+  } else if(is_(OBJECT, p) && !is_large(p)) {
+    return make_(OBJECT, compacted_index(p.i & VALUE_MASK.i));
+  }
+  return p;
 }
 
-typed_pointer make_procedure(typed_pointer params, typed_pointer body, typed_pointer env) {
-  push_root(params);
-  push_root(body);
-  typed_pointer acc = cons(env, empty_list);
-  acc = cons(pop_root(), acc);
-  acc = cons(pop_root(), acc);
-  return cons(procedure_symbol, acc);
+void mark_heap() {
+  uint64_t ssize = 256, sused = 0;
+  typed_pointer *stack = (typed_pointer*)malloc(sizeof(typed_pointer) * ssize);
+  mark_globals();
+  for(uint64_t i = 0; i < heap->rused + heap->gsize; i++) {
+    stack[sused++] = i < heap->rused ?
+      heap->gc_roots[i] : heap->globals[i - heap->rused];
+    while(sused > 0) {
+      typed_pointer p = stack[--sused];
+      uint64_t j = p.i & VALUE_MASK.i;
+      typed_pointer *slots;
+      uint64_t n;
+      if(is_(PAIR, p)) {
+        if(is_marked(j)) {
+          continue;
+        }
+        mark_element(j);
+        mark_element(j - 1);
+        slots = &heap->elements[j - 1];
+        n = 2;
+      } else if(is_large(p)) {
+        if(large_object(p)->marked) {
+          continue;
+        }
+        large_object(p)->marked = true;
+        slots = large_object(p)->slots + 1;
+        n = header_size(slots[-1]) - unscanned_elements(slots[-1]);
+      } else if(is_(OBJECT, p)) {
+        if(is_marked(j)) {
+          continue;
+        }
+        slots = &heap->elements[j + 1];
+        n = header_size(heap->elements[j]);
+        for(uint64_t k = 0; k <= n; k++) {
+          mark_element(j + k);
+        }
+        n -= unscanned_elements(heap->elements[j]);
+      } else {
+        if(is_(SYMBOL, p)) {
+          mark_symbol(p);
+        }
+        continue;
+      }
+      while(sused + n > ssize) {
+        ssize *= 2;
+        stack = (typed_pointer*)realloc(stack, sizeof(typed_pointer) * ssize);
+      }
+      for(uint64_t k = 0; k < n; k++) {
+        stack[sused++] = slots[k];
+      }
+    }
+  }
+  free(stack);
 }
 
-bool is_procedure(typed_pointer exp) {
-  return is_(PAIR, exp) && eq(car(exp), procedure_symbol);
+void compact_gc() {
+  double start = now();
+  uint64_t nwords = heap->eused / 64 + 1;
+  marks = (uint64_t*)calloc(nwords, sizeof(uint64_t));
+  mark_counts = (uint64_t*)malloc(sizeof(uint64_t) * nwords);
+  heap->collections++;
+
+  unmark_symbols(symbols);
+  mark_heap();
+  uint64_t live = 0;
+  for(uint64_t w = 0; w < nwords; w++) {
+    mark_counts[w] = live;
+    live += __builtin_popcountll(marks[w]);
+  }
+
+  for(uint64_t i = 0; i < heap->rused; i++) {
+    heap->gc_roots[i] = compacted(heap->gc_roots[i]);
+  }
+  for(uint64_t id = 0; id < heap->gsize; id++) {
+    heap->globals[id] = compacted(heap->globals[id]);
+  }
+  for(uint64_t i = 0; i < heap->lused; i++) {
+    large_object_t *l = &heap->large[i];
+    if(!l->marked) {
+      continue;
+    }
+    for(uint64_t k = 1 + unscanned_elements(l->slots[0]);
+        k <= header_size(l->slots[0]); k++) {
+      l->slots[k] = compacted(l->slots[k]);
+    }
+  }
+  for(uint64_t i = heap->space; i < heap->eused; i++) {
+    if(is_marked(i)) {
+      typed_pointer e = heap->elements[i];
+      heap->elements[compacted_index(i)] = compacted(e);
+      uint64_t n = unscanned_elements(e);
+      if(n > 0) {
+        memmove(&heap->elements[compacted_index(i + 1)],
+                &heap->elements[i + 1], sizeof(typed_pointer) * n);
+        i += n;
+      }
+    }
+  }
+  release_pages(heap->space + live, heap->eused);
+  heap->eused = heap->space + live;
+  sweep_large();
+  sweep_symbols(symbols);
+
+  free(marks);
+  free(mark_counts);
+  record_pause(start, &heap->gc_time);
 }
 
-typed_pointer procedure_params(typed_pointer exp) {
-  return car(cdr(exp));
+/* Parallel copying for full collections of large heaps. Every worker
+   copies into its own local allocation buffer, a chunk of the new
+   semispace claimed with an atomic add on eused, and scans what it
+   copied. A pair is claimed by compare-and-swapping its car with a
+   FORWARD pointer to the copy; the loser of a race gives its copy back.
+   When a buffer fills up, its unscanned part goes on the worker's range
+   deque, from which idle workers steal. The unused tails of the buffers
+   are filled with () so the semispace stays scannable. Objects are
+   claimed through their header the same way; one that does not fit in
+   what is left of the buffer gets a chunk of its own, pushed as a range
+   once it is claimed. Large objects go on a shared gray list. */
+#define GC_LAB_SIZE 1024
+#define GC_LAB_WASTE 16
+#define PARALLEL_GC_MIN (1 << 16)
+
+typedef struct gc_worker_t {
+  pthread_t thread;
+  uint64_t id;
+  uint64_t lab;
+  uint64_t lab_end;
+  uint64_t lab_scan;
+  uint64_t *ranges;
+  uint64_t rsize;
+  uint64_t rbottom;
+  uint64_t rtop;
+  pthread_mutex_t lock;
+} gc_worker_t;
+
+gc_worker_t *gc_workers;
+uint64_t gc_nworkers = 0;
+uint64_t gc_epoch = 0;
+uint64_t gc_running = 0;
+uint64_t gc_idle = 0;
+bool gc_stopping = false;
+pthread_mutex_t gc_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t gc_pool_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t gc_pool_done = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t gc_gray_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void push_range(gc_worker_t *w, uint64_t start, uint64_t end) {
+  pthread_mutex_lock(&w->lock);
+  if(w->rtop + 2 > w->rsize) {
+    w->rsize *= 2;
+    w->ranges = (uint64_t*)realloc(w->ranges, sizeof(uint64_t) * w->rsize);
+  }
+  w->ranges[w->rtop++] = start;
+  w->ranges[w->rtop++] = end;
+  pthread_mutex_unlock(&w->lock);
 }
 
-typed_pointer procedure_body(typed_pointer exp) {
-  return car(cdr(cdr(exp)));
+bool pop_range(gc_worker_t *w, uint64_t *start, uint64_t *end) {
+  bool found = false;
+  pthread_mutex_lock(&w->lock);
+  if(w->rtop > w->rbottom) {
+    *end = w->ranges[--w->rtop];
+    *start = w->ranges[--w->rtop];
+    found = true;
+  }
+  if(w->rtop == w->rbottom) {
+    w->rtop = w->rbottom = 0;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return found;
 }
 
-typed_pointer procedure_env(typed_pointer exp) {
-  return car(cdr(cdr(cdr(exp))));
+bool steal_range(gc_worker_t *w, uint64_t *start, uint64_t *end) {
+  bool found = false;
+  pthread_mutex_lock(&w->lock);
+  if(w->rtop > w->rbottom) {
+    *start = w->ranges[w->rbottom++];
+    *end = w->ranges[w->rbottom++];
+    found = true;
+  }
+  if(w->rtop == w->rbottom) {
+    w->rtop = w->rbottom = 0;
+  }
+  pthread_mutex_unlock(&w->lock);
+  return found;
 }
 
-typed_pointer operator(typed_pointer exp) {
-  return car(exp);
+bool has_ranges(gc_worker_t *w) {
+  pthread_mutex_lock(&w->lock);
+  bool found = w->rtop > w->rbottom;
+  pthread_mutex_unlock(&w->lock);
+  return found;
 }
 
-typed_pointer operands(typed_pointer exp) {
-  return cdr(exp);
+void fill_elements(uint64_t start, uint64_t end) {
+  for(uint64_t i = start; i < end; i++) {
+    heap->elements[i] = empty_list;
+  }
 }
 
-bool has_operands(typed_pointer ops) {
-  return !eq(ops, empty_list);
+void fill_lab(gc_worker_t *w) {
+  fill_elements(w->lab, w->lab_end);
+  w->lab = w->lab_end;
 }
 
-typed_pointer first_operand(typed_pointer ops) {
-  return car(ops);
+uint64_t claim_elements(uint64_t n) {
+  uint64_t start = __atomic_fetch_add(&heap->eused, n, __ATOMIC_RELAXED);
+  assert(start + n <= space_end());
+  return start;
 }
 
-typed_pointer rest_operands(typed_pointer ops) {
-  return cdr(ops);
+/* Allocates n elements for a copy, setting own when they are a chunk of
+   their own rather than part of the buffer. */
+uint64_t gc_alloc(gc_worker_t *w, uint64_t n, bool *own) {
+  *own = false;
+  if(w->lab + n > w->lab_end) {
+    if(n > GC_LAB_SIZE / 4 || w->lab_end - w->lab >= GC_LAB_WASTE) {
+      *own = true;
+      return claim_elements(n);
+    }
+    if(w->lab_scan < w->lab) {
+      push_range(w, w->lab_scan, w->lab);
+    }
+    fill_lab(w);
+    w->lab = w->lab_scan = claim_elements(GC_LAB_SIZE);
+    w->lab_end = w->lab + GC_LAB_SIZE;
+  }
+  w->lab += n;
+  return w->lab - n;
 }
 
-typed_pointer eval(typed_pointer exp, typed_pointer env);
+void push_gray(uint64_t id) {
+  pthread_mutex_lock(&gc_gray_lock);
+  push_id(&heap->lgray, id);
+  pthread_mutex_unlock(&gc_gray_lock);
+}
 
-typed_pointer list_of_values(typed_pointer ops, typed_pointer env) {
-  uint64_t i = 0;
-  typed_pointer evaled;
-  
-  while(has_operands(ops)) {
-    push_root(env);
-    push_root(rest_operands(ops));
-    evaled = eval(first_operand(ops), env);
-    ops = pop_root();
-    env = pop_root();
-    push_root(evaled);
-    i++;
+bool pop_gray(uint64_t *id) {
+  bool found = false;
+  pthread_mutex_lock(&gc_gray_lock);
+  if(heap->lgray.used > 0) {
+    *id = heap->lgray.ids[--heap->lgray.used];
+    found = true;
   }
+  pthread_mutex_unlock(&gc_gray_lock);
+  return found;
+}
 
-  typed_pointer res = empty_list;
-  while(i-- > 0) {
-    res = cons(pop_root(), res);
-  }
-  return res;
+bool has_gray() {
+  pthread_mutex_lock(&gc_gray_lock);
+  bool found = heap->lgray.used > 0;
+  pthread_mutex_unlock(&gc_gray_lock);
+  return found;
 }
 
-typed_pointer extend_env(typed_pointer vars, typed_pointer vals, typed_pointer base_env) {
-  push_root(base_env);
-  typed_pointer frame = make_frame(vars, vals);
-  base_env = pop_root();
-  return cons(frame, base_env);
+/* Pairs are claimed through their car, the higher of their two
+   elements, and objects through their header, the lowest of theirs.
+   Cells are claimed the same way but copied as ordinary pairs, each
+   taking one more element, which gc() allows for with heap->cells. */
+typed_pointer parallel_rellocate(gc_worker_t *w, typed_pointer p) {
+  typed_pointer type = {.i = p.i & TYPE_MASK.i};
+  if(is_large(p)) {
+    if(!__atomic_exchange_n(&large_object(p)->marked, true, __ATOMIC_ACQ_REL)) {
+      push_gray(p.i & VALUE_MASK.i & ~LARGE_OBJECT);
+    }
+    return p;
+  } else if(!is_(PAIR, p) && !is_(OBJECT, p)) {
+    if(is_(SYMBOL, p)) {
+      mark_symbol(p);
+    }
+    return p;
+  }
+  uint64_t i = is_(PAIR, p) ? pair_index(p) : p.i & VALUE_MASK.i;
+  uint64_t old = __atomic_load_n(&heap->elements[i].i, __ATOMIC_ACQUIRE);
+  if(is_(FORWARD, (typed_pointer){.i = old})) {
+    return make_(type, old);
+  } else if(is_(MOVED, (typed_pointer){.i = old})) {
+    return parallel_rellocate(w, make_(PAIR, old));
+  }
+  bool own;
+  uint64_t n = is_(PAIR, p) ? 2 : header_size((typed_pointer){.i = old}) + 1;
+  uint64_t j = gc_alloc(w, n, &own);
+  uint64_t to;
+  if(is_cell(p)) {
+    to = j + 1;
+    typed_pointer next = {.i = __atomic_load_n(&heap->elements[i+1].i,
+                                               __ATOMIC_ACQUIRE)};
+    heap->elements[j] = is_(LINK, next) ? link_tail(next) : make_cell(i + 1);
+    heap->elements[j+1].i = old;
+  } else if(is_(PAIR, p)) {
+    to = j + 1;
+    heap->elements[j] = heap->elements[i-1];
+    heap->elements[j+1].i = old;
+  } else {
+    to = j;
+    heap->elements[j].i = old;
+    memcpy(&heap->elements[j+1], &heap->elements[i+1],
+           sizeof(typed_pointer) * (n - 1));
+  }
+  uint64_t forward = make_(FORWARD, to).i;
+  if(__atomic_compare_exchange_n(&heap->elements[i].i, &old, forward,
+                                 false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    if(own) {
+      push_range(w, j, j + n);
+    }
+    return make_(type, to);
+  }
+  if(own) {
+    fill_elements(j, j + n);
+  } else {
+    w->lab -= n;
+  }
+  return make_(type, old);
 }
 
-typed_pointer eval_sequence(typed_pointer exps, typed_pointer env) {
-  while(!eq(cdr(exps), empty_list)) {
-    push_root(env);
-    push_root(cdr(exps));
-    eval(car(exps), env);
-    exps = pop_root();
-    env = pop_root();
+void parallel_scan_large(gc_worker_t *w, uint64_t id) {
+  typed_pointer *slots = heap->large[id].slots;
+  for(uint64_t k = 1 + unscanned_elements(slots[0]);
+      k <= header_size(slots[0]); k++) {
+    slots[k] = parallel_rellocate(w, slots[k]);
   }
-  return eval(car(exps), env);
 }
 
-typed_pointer compound_apply(typed_pointer op_val, typed_pointer ops_vals) {
-  push_root(procedure_body(op_val));
-  typed_pointer env = extend_env(procedure_params(op_val),
-                                 ops_vals,
-                                 procedure_env(op_val));
-  return eval_sequence(pop_root(), env);
+void parallel_scan(gc_worker_t *w, uint64_t i) {
+  heap->elements[i] = parallel_rellocate(w, heap->elements[i]);
 }
 
-typed_pointer primitive_apply(typed_pointer op_val, typed_pointer ops_vals) {
-  if(eq(op_val, primitive_cons)) {
-    return cons(car(ops_vals), car(cdr(ops_vals)));
-  } else if(eq(op_val, primitive_add)) {
-    return make_(FIXNUM,
-		 (unsigned int)((int)(car(ops_vals).i) +
-				(int)(car(cdr((ops_vals))).i)));
-  } else if(eq(op_val, primitive_sub)) {
-    return make_(FIXNUM,
-		 (unsigned int)((int)(car(ops_vals).i) -
-				(int)(car(cdr((ops_vals))).i)));
-  } else if(eq(op_val, primitive_mult)) {
-    return make_(FIXNUM,
-		 (unsigned int)((int)(car(ops_vals).i) *
-				(int)(car(cdr((ops_vals))).i)));
-  } else if(eq(op_val, primitive_eq)) {
-    if(eq(car(ops_vals), car(cdr((ops_vals))))) {
-      return true_symbol;
+bool find_work(gc_worker_t *w, uint64_t *start, uint64_t *end) {
+  if(pop_range(w, start, end)) {
+    return true;
+  }
+  for(uint64_t k = 1; k < gc_nworkers; k++) {
+    if(steal_range(&gc_workers[(w->id + k) % gc_nworkers], start, end)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* A worker only goes idle with an empty deque and nothing left to scan
+   in its buffer, and idle workers never produce work, so once all of
+   them are idle the copy is complete. */
+void parallel_copy(gc_worker_t *w) {
+  uint64_t start, end, id;
+  w->lab = w->lab_end = w->lab_scan = 0;
+  for(uint64_t i = w->id; i < heap->rused; i += gc_nworkers) {
+    heap->gc_roots[i] = parallel_rellocate(w, heap->gc_roots[i]);
+  }
+  for(uint64_t id = w->id; id < heap->gsize; id += gc_nworkers) {
+    heap->globals[id] = parallel_rellocate(w, heap->globals[id]);
+  }
+  if(w->id == 0) {
+    mark_globals();
+  }
+  while(true) {
+    if(w->lab_scan < w->lab) {
+      uint64_t i = w->lab_scan;
+      w->lab_scan += 1 + unscanned_elements(heap->elements[i]);
+      parallel_scan(w, i);
+    } else if(find_work(w, &start, &end)) {
+      for(uint64_t i = start; i < end;
+          i += 1 + unscanned_elements(heap->elements[i])) {
+        parallel_scan(w, i);
+      }
+    } else if(pop_gray(&id)) {
+      parallel_scan_large(w, id);
     } else {
-      return false_symbol;
+      __atomic_fetch_add(&gc_idle, 1, __ATOMIC_ACQ_REL);
+      bool done = true;
+      while(__atomic_load_n(&gc_idle, __ATOMIC_ACQUIRE) < gc_nworkers) {
+        bool found = has_gray();
+        for(uint64_t k = 0; k < gc_nworkers && !found; k++) {
+          found = has_ranges(&gc_workers[k]);
+        }
+        if(found) {
+          __atomic_fetch_sub(&gc_idle, 1, __ATOMIC_ACQ_REL);
+          done = false;
+          break;
+        }
+        sched_yield();
+      }
+      if(done) {
+        break;
+      }
     }
   }
-  return op_not_found;
+  fill_lab(w);
 }
 
-typed_pointer apply(typed_pointer op_val,  typed_pointer ops_vals) {
-  if(is_procedure(op_val)) {
-    return compound_apply(op_val, ops_vals);
-  } else {
-    return primitive_apply(op_val, ops_vals);
+void* gc_worker_main(void *arg) {
+  gc_worker_t *w = (gc_worker_t*)arg;
+  uint64_t epoch = 0;
+  while(true) {
+    pthread_mutex_lock(&gc_pool_lock);
+    while(gc_epoch == epoch && !gc_stopping) {
+      pthread_cond_wait(&gc_pool_start, &gc_pool_lock);
+    }
+    epoch = gc_epoch;
+    pthread_mutex_unlock(&gc_pool_lock);
+    if(gc_stopping) {
+      break;
+    }
+
+    parallel_copy(w);
+
+    pthread_mutex_lock(&gc_pool_lock);
+    if(--gc_running == 0) {
+      pthread_cond_signal(&gc_pool_done);
+    }
+    pthread_mutex_unlock(&gc_pool_lock);
   }
+  return NULL;
 }
 
-typed_pointer eval(typed_pointer exp, typed_pointer env) {
-  if(is_self_evaluating(exp)) {
-    return exp;
-  } else if(is_variable(exp)) {
-    return lookup_variable_value(exp, env);
-  } else if (is_quoted(exp)) {
-    return text_of_quotation(exp);
-  } else if (is_assignment(exp)) {
-    return set_var_val(assignment_var(exp), assignment_val(exp), env);
-  } else if (is_definition(exp)) {
-    push_root(exp);
-    push_root(env);
-    typed_pointer dval = def_val(exp);
-    typed_pointer val  = eval(dval, peek_root());
-    env = pop_root();
-    exp = pop_root();
-    return define_var(def_var(exp), val, env);
-  } else if (is_if(exp)) {
-    push_root(exp);
-    push_root(env);
-    typed_pointer pred_val = eval(if_predicate(exp), env);
-    env = pop_root();
-    exp = pop_root();
-    if(eq(pred_val, false_symbol)) {
-      return eval(if_alternative(exp), env);
-    } else {
-      return eval(if_consequent(exp), env);
+/* The worker pool is started by the first parallel collection with
+   heap->threads workers, the calling thread being worker 0, and started
+   again with the new number when heap->threads changes. It is stopped
+   when a heap is freed. */
+void start_gc_workers() {
+  gc_nworkers = heap->threads;
+  gc_workers = (gc_worker_t*)calloc(gc_nworkers, sizeof(gc_worker_t));
+  for(uint64_t i = 0; i < gc_nworkers; i++) {
+    gc_workers[i].id = i;
+    gc_workers[i].rsize = 64;
+    gc_workers[i].ranges = (uint64_t*)malloc(sizeof(uint64_t) * 64);
+    pthread_mutex_init(&gc_workers[i].lock, NULL);
+    if(i > 0) {
+      pthread_create(&gc_workers[i].thread, NULL, gc_worker_main,
+                     &gc_workers[i]);
     }
-  } else if (is_lambda(exp)) {
-    return make_procedure(lambda_parameters(exp), lambda_body(exp), env);
-  } else {
-    assert(is_application(exp));
-    typed_pointer ops = operands(exp);
-    push_root(env);
-    push_root(ops);
-    typed_pointer op_val = eval(operator(exp), env);
-    ops = pop_root();
-    env = pop_root();
-    push_root(op_val);
-    typed_pointer ops_vals = list_of_values(ops, env);
-    op_val = pop_root();
-    return apply(op_val, ops_vals);
   }
 }
 
-void setup_env() {
-  empty_list = insert_symbol("()");
-  quote_symbol = insert_symbol("quote");
-  set_symbol = insert_symbol("set!");
-  define_symbol = insert_symbol("define");
-  if_symbol = insert_symbol("if");
-  lambda_symbol = insert_symbol("lambda");
-  true_symbol = insert_symbol("#t");
-  false_symbol = insert_symbol("#f");
-  broken_heart = insert_symbol("#BROKEN-HEART#");
-  var_not_found = insert_symbol("#VAR-NOT-FOUND#");
-  op_not_found = insert_symbol("#OP-NOT-FOUND#");
-  procedure_symbol = insert_symbol("#PROCEDURE#");
+void stop_gc_workers() {
+  if(gc_nworkers == 0) {
+    return;
+  }
+  pthread_mutex_lock(&gc_pool_lock);
+  gc_stopping = true;
+  pthread_cond_broadcast(&gc_pool_start);
+  pthread_mutex_unlock(&gc_pool_lock);
+  for(uint64_t i = 0; i < gc_nworkers; i++) {
+    if(i > 0) {
+      pthread_join(gc_workers[i].thread, NULL);
+    }
+    pthread_mutex_destroy(&gc_workers[i].lock);
+    free(gc_workers[i].ranges);
+  }
+  free(gc_workers);
+  gc_workers = NULL;
+  gc_nworkers = 0;
+  gc_epoch = 0;
+  gc_stopping = false;
+}
+
+void parallel_gc() {
+  if(gc_nworkers != heap->threads) {
+    stop_gc_workers();
+    start_gc_workers();
+  }
+  pthread_mutex_lock(&gc_pool_lock);
+  gc_idle = 0;
+  gc_running = gc_nworkers;
+  gc_epoch++;
+  pthread_cond_broadcast(&gc_pool_start);
+  pthread_mutex_unlock(&gc_pool_lock);
+
+  parallel_copy(&gc_workers[0]);
 
-  primitive_cons = make_(PRIMITIVE, 0);
-  primitive_add = make_(PRIMITIVE, 1);
-  primitive_sub = make_(PRIMITIVE, 2);
-  primitive_mult = make_(PRIMITIVE, 3);
-  primitive_eq = make_(PRIMITIVE, 4);
-
-  typed_pointer primitive_proc_names = read_sexp("(eq? mult sub cons add)");
-  push_root(primitive_proc_names);
-  typed_pointer primitive_proc_objects =
-    cons(primitive_eq,
-	 cons(primitive_mult,
-	      cons(primitive_sub,
-		   cons(primitive_cons,
-			cons(primitive_add, empty_list)))));
-  primitive_proc_names = pop_root();
-  typed_pointer init_env = extend_env(primitive_proc_names,
-                                      primitive_proc_objects,
-                                      empty_list);
-  push_root(init_env);
+  pthread_mutex_lock(&gc_pool_lock);
+  gc_running--;
+  while(gc_running > 0) {
+    pthread_cond_wait(&gc_pool_done, &gc_pool_lock);
+  }
+  pthread_mutex_unlock(&gc_pool_lock);
 }
 
-void repl(FILE *f) {
-  char c;
-  int64_t balance = 0;
+/* Full collection: flips the semispaces and copies everything reachable
+   from the roots, emptying the nursery. The semispaces are grown first
+   if the old generation and the nursery together might not fit; when
+   emax stops them short, the copy reports the heap exhausted if the
+   survivors really overflow. An incremental collection in progress is
+   finished first, and large heaps are copied in parallel when more than
+   one thread is allowed and the semispaces are large enough. */
+void gc() {
+  if(heap->compact) {
+    compact_gc();
+    return;
+  }
+  if(heap->collecting) {
+    gc_step(UINT64_MAX);
+  }
+  double start = now();
+  uint64_t used = heap->eused - heap->sstart + heap->nused;
+  bool parallel = heap->threads > 1 && used >= PARALLEL_GC_MIN;
+  if(parallel) {
+    used += heap->cells + heap->threads * 2 * GC_LAB_SIZE + used / 32;
+  }
+  bool fits = used <= heap->esize || grow_heap(used);
+  parallel = parallel && fits;
+  flip();
+  heap->clo = 0;
+  heap->chi = UINT64_MAX;
+  heap->collections++;
   
-  uint64_t ssize = 4096;
-  uint64_t sused = 0;
-  char s[ssize];
+  if(parallel) {
+    parallel_gc();
+  } else {
+    rellocate_roots();
+    scan_elements(heap->space);
+  }
+  release_other_space();
 
-  printf("> ");
-  while((c = getc(f)) != EOF) {
-    while(isspace(c)) {
-      c = getc(f);
-    }
+  heap->nused = 0;
+  heap->mused = 0;
+  clear_dirty();
+  sweep_large();
+  sweep_symbols(symbols);
+  record_pause(start, &heap->gc_time);
+}
 
-    while(!(isspace(c) && balance == 0)) {
-      if(c == '('){
-	balance++;
-      }
-      if(c == ')'){
-	balance--;
-      }
-      assert(sused < ssize);
-      s[sused++] = c;
-      c = getc(f);
+/* Starts an incremental collection: flips the semispaces and moves only
+   the roots and globals. The rest is copied by gc_step and by the read barrier. */
+void start_gc() {
+  double start = now();
+  heap->clo = heap->space;
+  heap->chi = heap->space + heap->esize;
+  flip();
+  heap->scan = heap->space;
+  heap->collecting = true;
+  heap->collections++;
+
+  rellocate_roots();
+  record_pause(start, &heap->gc_time);
+}
+
+void resize_heap(uint64_t nelems);
+
+/* Scans at most budget elements of the current semispace, finishing the
+   incremental collection once the scan catches up with allocation. The
+   symbols on the root stack and in globals are marked then, since roots
+   pushed and globals defined after the flip were never relocated, and the semispaces are resized as
+   after a full collection. */
+void gc_step(uint64_t budget) {
+  double start = now();
+  while(budget > 0 && (heap->scan < heap->eused || heap->lgray.used > 0)) {
+    if(heap->scan < heap->eused) {
+      heap->elements[heap->scan] = rellocate_root(heap->elements[heap->scan]);
+      heap->scan += 1 + unscanned_elements(heap->elements[heap->scan]);
+      budget--;
+    } else {
+      uint64_t n = scan_large(heap->lgray.ids[--heap->lgray.used]);
+      budget = n < budget ? budget - n : 0;
     }
-    s[sused] = '\0';
-    typed_pointer res = read_sexp(s);
-    res = eval(res, peek_root());
-    char *rs = sexp_to_str(res);
-    printf("%s\n", rs);
-    free(rs);
-    sused = 0;
-    printf("> ");
   }
+  if(heap->scan == heap->eused && heap->lgray.used == 0) {
+    release_other_space();
+    for(uint64_t i = 0; i < heap->rused; i++) {
+      symbol_barrier(heap->gc_roots[i]);
+    }
+    for(uint64_t id = 0; id < heap->gsize; id++) {
+      symbol_barrier(heap->globals[id]);
+    }
+    mark_globals();
+    heap->collecting = false;
+    heap->clo = 0;
+    heap->chi = 0;
+    sweep_large();
+    sweep_symbols(symbols);
+    resize_heap(0);
+  }
+  record_pause(start, &heap->gc_time);
 }
 
-int main(int argc, char** argv) {
-  setvbuf(stdout, NULL, _IONBF, 0);
+/* Minor collection: promotes the nursery survivors into the current
+   semispace. Only the roots, the dirty globals, the remembered slots,
+   the dirty large objects and the promoted elements are scanned, so the
+   cost does not depend on the size of the old generation or on the
+   number of globals. Symbols are left unmarked, since only full
+   collections sweep them. */
+void minor_gc() {
+  double start = now();
+  uint64_t scan = heap->eused;
+  heap->clo = 0;
+  heap->chi = heap->nsize;
+  heap->minor_collections++;
+
+  for(uint64_t i = 0; i < heap->rused; i++) {
+    heap->gc_roots[i] = rellocate_root(heap->gc_roots[i]);
+  }
+  for(uint64_t i = 0; i < heap->gdirty.used; i++) {
+    uint64_t id = heap->gdirty.ids[i];
+    heap->globals[id] = rellocate_root(heap->globals[id]);
+  }
+  for(uint64_t i = 0; i < heap->mused; i++){
+    uint64_t slot = heap->remembered[i];
+    heap->elements[slot] = rellocate_root(heap->elements[slot]);
+  }
+  for(uint64_t i = 0; i < heap->ldirty.used; i++) {
+    scan_large(heap->ldirty.ids[i]);
+  }
+  clear_dirty();
+  scan_elements(scan);
 
-  symbols = make_vector(50);
-  heap = make_heap(512, 64);
+  heap->nused = 0;
+  heap->mused = 0;
+  record_pause(start, &heap->minor_gc_time);
+}
 
-  setup_env();
-  repl(stdin);
-  
-  free_vector(symbols);
-  free_heap(heap);
+/* Resize both semispaces after a full collection so that the survivors
+   plus a nursery worth of promotions occupy at most half of the space,
+   shrinking back towards emin when most of the heap died. Live data in
+   the upper semispace stays where it is and becomes part of the new
+   lower semispace; when the new size does not cover it, it is first
+   copied down with another flip. Cells count as the pairs they stand
+   for, so that cdr-coding makes each collection cheaper rather than
+   making them more frequent. */
+void resize_heap(uint64_t nelems) {
+  uint64_t live = heap->eused - heap->sstart + heap->nsize + heap->cells;
+  uint64_t size = heap->esize;
+  while(size < heap->emax && (live + nelems) * 2 > size) {
+    size *= 2;
+  }
+  while(size / 2 >= heap->emin && (live + nelems) * 8 < size) {
+    size /= 2;
+  }
+  if(size > heap->emax) {
+    size = heap->emax;
+  }
+  if(size == heap->esize) {
+    return;
+  }
+  if(heap->eused > heap->nsize + size) {
+    gc();
+  }
+  resize_block(size);
+  heap->space = heap->nsize;
+}
+
+void heap_exhausted() {
+  fprintf(stderr, "heap exhausted: %lu elements live, maximum %lu\n",
+          heap->eused - heap->sstart, heap->emax);
+  assert(false);
+}
+
+/* Make room for nelems new elements in the semispace, collecting only
+   when it is exhausted. Everything live must be reachable from the
+   roots. An incremental heap starts a collection instead once it
+   reaches the incremental limit, and scans in proportion to nelems
+   before allocating them, as make_object does during a collection. */
+void reserve_old(uint64_t nelems) {
+  if(heap->eused + nelems <= allocation_end()) {
+    return;
+  }
+  if(heap->collecting) {
+    gc_step(UINT64_MAX);
+  } else if(heap->slice > 0 && heap->eused <= incremental_limit()) {
+    start_gc();
+    gc_step(heap->slice * ((nelems + 1) / 2));
+    if(heap->eused + nelems <= allocation_end()) {
+      return;
+    }
+    gc_step(UINT64_MAX);
+  } else {
+    gc();
+  }
+  resize_heap(nelems);
+  if(!has_room(nelems)) {
+    heap_exhausted();
+  }
+}
+
+/* Make room for nelems new elements in the nursery. A minor collection
+   is enough as long as the old generation can take every nursery pair
+   and the symbol table has not outgrown its limit; otherwise the whole
+   heap is collected. */
+void reserve_young(uint64_t nelems) {
+  if(nursery_has_room(nelems)) {
+    return;
+  }
+  if(has_room(heap->nused) && live_symbols(symbols) <= symbols->limit) {
+    minor_gc();
+  } else {
+    gc();
+    resize_heap(0);
+  }
+  if(!nursery_has_room(nelems)) {
+    heap_exhausted();
+  }
+}
+
+bool can_allocate(uint64_t nelems) {
+  if(heap->nsize == 0) {
+    return heap->eused + nelems <= allocation_end();
+  }
+  return nursery_has_room(nelems);
+}
+
+/* Make room for nelems elements of new pairs wherever the mutator
+   allocates them. */
+void reserve(uint64_t nelems) {
+  if(heap->nsize == 0) {
+    reserve_old(nelems);
+  } else {
+    reserve_young(nelems);
+  }
+}
+
+typed_pointer allocate_pair() {
+  return heap->nsize == 0 ? make_pair() : make_young_pair();
+}
+
+/* The root stack grows as needed, so its depth only bounds memory. */
+void push_root(typed_pointer root) {
+  if(heap->rused == heap->rsize) {
+    heap->rsize *= 2;
+    heap->gc_roots = (typed_pointer*)realloc(heap->gc_roots,
+                                             sizeof(typed_pointer) *
+                                             heap->rsize);
+    assert(heap->gc_roots != NULL);
+  }
+  heap->gc_roots[heap->rused++] = root;
+}
+
+/* Scopes let a function root several values as handles and drop them
+   all at once. A handle is the index of its root, so it stays valid
+   when the stack grows or a collection moves the value; it is read and
+   updated with handle_ref and handle_set. With CHECK_ROOTS defined,
+   scopes must be left innermost first with nothing of theirs popped
+   already, and pop_root may not reach into the innermost scope's
+   enclosing ones. */
+typedef uint64_t handle;
+
+uint64_t enter_scope() {
+#ifdef CHECK_ROOTS
+  push_id(&heap->scopes, heap->rused);
+#endif
+  return heap->rused;
+}
+
+void leave_scope(uint64_t scope) {
+#ifdef CHECK_ROOTS
+  assert(heap->scopes.used > 0 &&
+         heap->scopes.ids[heap->scopes.used - 1] == scope);
+  assert(heap->rused >= scope);
+  heap->scopes.used--;
+#endif
+  heap->rused = scope;
+}
+
+handle make_handle(typed_pointer root) {
+  push_root(root);
+  return heap->rused - 1;
+}
+
+typed_pointer handle_ref(handle h) {
+  return heap->gc_roots[h];
+}
+
+void handle_set(handle h, typed_pointer root) {
+  heap->gc_roots[h] = root;
+}
+
+typed_pointer pop_root() {
+#ifdef CHECK_ROOTS
+  assert(heap->scopes.used == 0 ||
+         heap->rused > heap->scopes.ids[heap->scopes.used - 1]);
+#endif
+  assert(heap->rused > 0);
+  return heap->gc_roots[--(heap->rused)];
+}
+
+typed_pointer peek_root() {
+  return heap->gc_roots[heap->rused-1];
+}
+
+typed_pointer cons(typed_pointer tcar, typed_pointer tcdr) {
+  if(!can_allocate(2) || heap->collecting) {
+    push_root(tcar);
+    push_root(tcdr);
+    if(heap->collecting) {
+      gc_step(heap->slice);
+    }
+    reserve(2);
+    tcdr = pop_root();
+    tcar = pop_root();
+  }
+  typed_pointer new_pair = allocate_pair();
+  set_car(new_pair, tcar);
+  set_cdr(new_pair, tcdr);
+  return new_pair;
+}
+
+/* Pops the tail on top of the stack and the n values below it into a
+   list of those values ending in the tail. Room for all of its pairs is
+   reserved at once, wherever make_object would put an object that
+   size. */
+typed_pointer list_from_stack(uint64_t n) {
+  bool young = heap->nsize > 0 && 2 * n <= heap->nsize / 4;
+  if(heap->collecting) {
+    gc_step(heap->slice * n);
+  }
+  if(young) {
+    reserve_young(2 * n);
+  } else {
+    reserve_old(2 * n);
+  }
+  typed_pointer list = pop_root();
+  for(uint64_t k = 0; k < n; k++) {
+    typed_pointer pair = young ? make_young_pair() : make_pair();
+    set_car(pair, pop_root());
+    set_cdr(pair, list);
+    list = pair;
+  }
+  return list;
+}
+
+/* Replaces a cell with an ordinary pair of its car and e. */
+void move_cell(typed_pointer cell, typed_pointer e) {
+  push_root(cell);
+  typed_pointer pair = cons(car(cell), e);
+  cell = resolve(pop_root());
+  if(!is_cell(cell)) {
+    set_cdr(cell, cdr(pair));
+    return;
+  }
+  uint64_t i = pair_index(cell);
+  if(is_young(pair) && !is_young(cell)) {
+    remember(i);
+  }
+  heap->elements[i] = make_(MOVED, pair.i);
+}
+
+typed_pointer make_large_object(uint64_t kind, uint64_t size) {
+  if(heap->lelems + size + 1 > heap->llimit) {
+    gc();
+  }
+  uint64_t id = 0;
+  while(id < heap->lused && heap->large[id].slots != NULL) {
+    id++;
+  }
+  if(id == heap->lused) {
+    if(heap->lused >= heap->lsize) {
+      heap->lsize = heap->lsize > 0 ? heap->lsize * 2 : 16;
+      heap->large = (large_object_t*)realloc(heap->large,
+                                             sizeof(large_object_t) *
+                                             heap->lsize);
+    }
+    heap->lused++;
+  }
+  large_object_t *l = &heap->large[id];
+  l->slots = (typed_pointer*)malloc(sizeof(typed_pointer) * (size + 1));
+  assert(l->slots != NULL);
+  l->slots[0] = make_header(kind, size);
+  for(uint64_t k = 1; k <= size; k++) {
+    l->slots[k] = empty_list;
+  }
+  l->marked = heap->collecting;
+  l->dirty = false;
+  heap->lelems += size + 1;
+  return make_(OBJECT, LARGE_OBJECT | id);
+}
+
+/* Allocates an object of size elements, all (). Objects taking more
+   than a quarter of the nursery go straight to the semispace. Anything
+   the caller still needs must be rooted, as this may collect. */
+typed_pointer make_object(uint64_t kind, uint64_t size) {
+  uint64_t n = size + 1, i;
+  if(n >= LARGE_OBJECT_SIZE) {
+    return make_large_object(kind, size);
+  }
+  if(heap->collecting) {
+    gc_step(heap->slice * ((n + 1) / 2));
+  }
+  if(heap->nsize > 0 && n <= heap->nsize / 4) {
+    reserve_young(n);
+    i = heap->nused;
+    heap->nused += n;
+  } else {
+    reserve_old(n);
+    i = heap->eused;
+    heap->eused += n;
+  }
+  heap->elements[i] = make_header(kind, size);
+  for(uint64_t k = 1; k < n; k++) {
+    heap->elements[i + k] = empty_list;
+  }
+  return make_(OBJECT, i);
+}
+
+/* A record is an object whose first element is its type. */
+typed_pointer make_record(typed_pointer type, uint64_t nfields) {
+  push_root(type);
+  typed_pointer record = make_object(RECORD_OBJECT, nfields + 1);
+  object_set(record, 0, pop_root());
+  return record;
+}
+
+typed_pointer record_type(typed_pointer record) {
+  assert(is_object(record, RECORD_OBJECT));
+  return object_ref(record, 0);
+}
+
+typed_pointer record_ref(typed_pointer record, uint64_t k) {
+  assert(is_object(record, RECORD_OBJECT));
+  return object_ref(record, k + 1);
+}
+
+void record_set(typed_pointer record, uint64_t k, typed_pointer e) {
+  assert(is_object(record, RECORD_OBJECT));
+  object_set(record, k + 1, e);
+}
+
+/* Bignums are never made for integers that fit a fixnum, and have no
+   leading zero limbs, so each integer has one representation. Their
+   arithmetic works on magnitudes in malloc'd buffers and allocates only
+   the result. Products of at least KARATSUBA_MIN limbs a side split
+   their operands in halves and make three half-size products rather
+   than four. */
+#define KARATSUBA_MIN 32
+#define DECIMAL_LIMB 10000000000000000000ULL
+#define DECIMAL_LIMB_DIGITS 19
+
+typedef unsigned __int128 uint128_t;
+
+bool is_bignum(typed_pointer p) {
+  return is_object(p, BIGNUM_OBJECT);
+}
+
+bool is_integer(typed_pointer p) {
+  return is_(FIXNUM, p) || is_bignum(p);
+}
+
+/* An integer as a sign and the n limbs of its magnitude. The limbs of a
+   bignum are read in place, so they are only valid until the next
+   allocation. */
+typedef struct integer_t {
+  bool negative;
+  uint64_t n;
+  const uint64_t *limbs;
+  uint64_t small;
+} integer_t;
+
+void integer_parts(typed_pointer x, integer_t *r) {
+  if(is_(FIXNUM, x)) {
+    int64_t v = fixnum_value(x);
+    r->negative = v < 0;
+    r->small = v < 0 ? -(uint64_t)v : (uint64_t)v;
+    r->limbs = &r->small;
+    r->n = v != 0;
+  } else {
+    r->negative = object_slots(x)[1].i;
+    r->n = object_size(x) - 1;
+    r->limbs = (const uint64_t*)(object_slots(x) + 2);
+  }
+}
+
+/* The integer of the given sign and n limbs of magnitude, which must
+   not be in the heap. */
+typed_pointer make_integer_from(bool negative, const uint64_t *limbs,
+                                uint64_t n) {
+  while(n > 0 && limbs[n - 1] == 0) {
+    n--;
+  }
+  if(n == 0) {
+    return make_(FIXNUM, 0);
+  } else if(n == 1 && limbs[0] <= (uint64_t)FIXNUM_MAX + negative) {
+    return make_(FIXNUM, negative ? -limbs[0] : limbs[0]);
+  }
+  typed_pointer bignum = make_object(BIGNUM_OBJECT, n + 1);
+  object_slots(bignum)[1].i = negative;
+  memcpy(object_slots(bignum) + 2, limbs, sizeof(uint64_t) * n);
+  return bignum;
+}
+
+typed_pointer make_integer(int64_t v) {
+  if(v >= FIXNUM_MIN && v <= FIXNUM_MAX) {
+    return make_(FIXNUM, (uint64_t)v);
+  }
+  uint64_t m = v < 0 ? -(uint64_t)v : (uint64_t)v;
+  return make_integer_from(v < 0, &m, 1);
+}
+
+int mag_cmp(const uint64_t *a, uint64_t na, const uint64_t *b, uint64_t nb) {
+  if(na != nb) {
+    return na < nb ? -1 : 1;
+  }
+  while(na-- > 0) {
+    if(a[na] != b[na]) {
+      return a[na] < b[na] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+/* Adds the na limbs of a into the nr of r, na <= nr, returning the
+   carry out of r. */
+uint64_t mag_add_into(uint64_t *r, uint64_t nr, const uint64_t *a,
+                      uint64_t na) {
+  uint64_t carry = 0, k = 0;
+  for(; k < na; k++) {
+    uint128_t t = (uint128_t)r[k] + a[k] + carry;
+    r[k] = (uint64_t)t;
+    carry = (uint64_t)(t >> 64);
+  }
+  for(; carry > 0 && k < nr; k++) {
+    carry = ++r[k] == 0;
+  }
+  return carry;
+}
+
+/* Subtracts the na limbs of a from the nr of r, which must be at least
+   a. */
+void mag_sub_from(uint64_t *r, uint64_t nr, const uint64_t *a, uint64_t na) {
+  uint64_t borrow = 0, k = 0;
+  for(; k < na; k++) {
+    uint64_t x = r[k];
+    r[k] = x - a[k] - borrow;
+    borrow = x < a[k] || (x == a[k] && borrow);
+  }
+  for(; borrow > 0 && k < nr; k++) {
+    borrow = r[k]-- == 0;
+  }
+}
+
+/* Writes a times b into the na + nb limbs of r, which overlaps
+   neither. */
+void mag_mul(uint64_t *r, const uint64_t *a, uint64_t na, const uint64_t *b,
+             uint64_t nb) {
+  if(na < nb) {
+    mag_mul(r, b, nb, a, na);
+    return;
+  }
+  if(nb < KARATSUBA_MIN) {
+    memset(r, 0, sizeof(uint64_t) * (na + nb));
+    for(uint64_t i = 0; i < nb; i++) {
+      uint64_t carry = 0;
+      for(uint64_t j = 0; j < na; j++) {
+        uint128_t t = (uint128_t)a[j] * b[i] + r[i + j] + carry;
+        r[i + j] = (uint64_t)t;
+        carry = (uint64_t)(t >> 64);
+      }
+      r[i + na] = carry;
+    }
+    return;
+  }
+  uint64_t m = na / 2;
+  if(nb <= m) {
+    /* Too unbalanced to split b: a0 b + a1 b << m. */
+    uint64_t nt = na - m + nb;
+    uint64_t *t = (uint64_t*)malloc(sizeof(uint64_t) * nt);
+    mag_mul(r, a, m, b, nb);
+    memset(r + m + nb, 0, sizeof(uint64_t) * (na - m));
+    mag_mul(t, a + m, na - m, b, nb);
+    mag_add_into(r + m, na + nb - m, t, nt);
+    free(t);
+    return;
+  }
+  /* z0 = a0 b0 and z2 = a1 b1 go straight into r, then
+     z1 = (a0 + a1)(b0 + b1) - z0 - z2 is added in at m. */
+  uint64_t ns = na - m + 1, nz = na + nb - m;
+  uint64_t *sa = (uint64_t*)calloc(ns, sizeof(uint64_t));
+  uint64_t *sb = (uint64_t*)calloc(ns, sizeof(uint64_t));
+  uint64_t *z1 = (uint64_t*)malloc(sizeof(uint64_t) * 2 * ns);
+  memcpy(sa, a, sizeof(uint64_t) * m);
+  mag_add_into(sa, ns, a + m, na - m);
+  memcpy(sb, b, sizeof(uint64_t) * m);
+  mag_add_into(sb, ns, b + m, nb - m);
+  mag_mul(r, a, m, b, m);
+  mag_mul(r + 2 * m, a + m, na - m, b + m, nb - m);
+  mag_mul(z1, sa, ns, sb, ns);
+  mag_sub_from(z1, 2 * ns, r, 2 * m);
+  mag_sub_from(z1, 2 * ns, r + 2 * m, na + nb - 2 * m);
+  mag_add_into(r + m, nz, z1, 2 * ns < nz ? 2 * ns : nz);
+  free(sa);
+  free(sb);
+  free(z1);
+}
+
+/* x + y, or x - y if subtract, for integers x and y. */
+typed_pointer integer_add(typed_pointer x, typed_pointer y, bool subtract) {
+  if(!is_integer(x) || !is_integer(y)) {
+    return wrong_type;
+  }
+  integer_t a, b;
+  integer_parts(x, &a);
+  integer_parts(y, &b);
+  bool bnegative = b.negative != subtract, negative = a.negative;
+  uint64_t n = (a.n > b.n ? a.n : b.n) + 1;
+  uint64_t *r = (uint64_t*)calloc(n, sizeof(uint64_t));
+  if(a.negative == bnegative) {
+    memcpy(r, a.limbs, sizeof(uint64_t) * a.n);
+    mag_add_into(r, n, b.limbs, b.n);
+  } else if(mag_cmp(a.limbs, a.n, b.limbs, b.n) >= 0) {
+    memcpy(r, a.limbs, sizeof(uint64_t) * a.n);
+    mag_sub_from(r, n, b.limbs, b.n);
+  } else {
+    memcpy(r, b.limbs, sizeof(uint64_t) * b.n);
+    mag_sub_from(r, n, a.limbs, a.n);
+    negative = bnegative;
+  }
+  typed_pointer res = make_integer_from(negative, r, n);
+  free(r);
+  return res;
+}
+
+typed_pointer integer_mul(typed_pointer x, typed_pointer y) {
+  if(!is_integer(x) || !is_integer(y)) {
+    return wrong_type;
+  }
+  integer_t a, b;
+  integer_parts(x, &a);
+  integer_parts(y, &b);
+  if(a.n == 0 || b.n == 0) {
+    return make_(FIXNUM, 0);
+  }
+  uint64_t *r = (uint64_t*)malloc(sizeof(uint64_t) * (a.n + b.n));
+  mag_mul(r, a.limbs, a.n, b.limbs, b.n);
+  typed_pointer res = make_integer_from(a.negative != b.negative, r,
+                                        a.n + b.n);
+  free(r);
+  return res;
+}
+
+/* The integer of the len characters at token, an optional sign and
+   decimal digits, accumulated DECIMAL_LIMB_DIGITS digits at a time. */
+typed_pointer read_integer(const char *token, uint64_t len) {
+  bool negative = token[0] == '-';
+  const char *digits = token + (token[0] == '-' || token[0] == '+');
+  len -= digits - token;
+  uint64_t n = len / DECIMAL_LIMB_DIGITS + 1;
+  uint64_t *r = (uint64_t*)calloc(n, sizeof(uint64_t));
+  uint64_t step = len % DECIMAL_LIMB_DIGITS;
+  for(uint64_t k = 0; k < len; step = DECIMAL_LIMB_DIGITS) {
+    uint64_t chunk = 0, scale = 1;
+    for(uint64_t end = k + (step > 0 ? step : DECIMAL_LIMB_DIGITS); k < end;
+        k++) {
+      chunk = chunk * 10 + (uint64_t)(digits[k] - '0');
+      scale *= 10;
+    }
+    for(uint64_t i = 0; i < n; i++) {
+      uint128_t t = (uint128_t)r[i] * scale + chunk;
+      r[i] = (uint64_t)t;
+      chunk = (uint64_t)(t >> 64);
+    }
+  }
+  typed_pointer res = make_integer_from(negative, r, n);
+  free(r);
+  return res;
+}
+
+/* Prints an integer by dividing its magnitude by DECIMAL_LIMB until
+   nothing is left, which allocates nothing in the heap. */
+char* integer_to_str(typed_pointer x) {
+  integer_t a;
+  integer_parts(x, &a);
+  uint64_t n = a.n, nchunks = 0;
+  uint64_t *m = (uint64_t*)malloc(sizeof(uint64_t) * (n + 1));
+  uint64_t *chunks = (uint64_t*)malloc(sizeof(uint64_t) * (2 * n + 1));
+  memcpy(m, a.limbs, sizeof(uint64_t) * n);
+  do {
+    uint128_t rem = 0;
+    for(uint64_t k = n; k-- > 0;) {
+      uint128_t t = rem << 64 | m[k];
+      m[k] = (uint64_t)(t / DECIMAL_LIMB);
+      rem = t % DECIMAL_LIMB;
+    }
+    chunks[nchunks++] = (uint64_t)rem;
+    while(n > 0 && m[n - 1] == 0) {
+      n--;
+    }
+  } while(n > 0);
+  char *res = calloc(nchunks * DECIMAL_LIMB_DIGITS + 2, sizeof(char));
+  int used = sprintf(res, "%s%llu", a.negative ? "-" : "",
+                     (unsigned long long)chunks[nchunks - 1]);
+  for(uint64_t k = nchunks - 1; k-- > 0;) {
+    used += sprintf(res + used, "%019llu", (unsigned long long)chunks[k]);
+  }
+  free(m);
+  free(chunks);
+  return res;
+}
+
+/* A reader parses data out of a buffer refilled from f a line at a
+   time, so that it never waits for more of an interactive input than
+   the datum it is reading, or out of a string read in place when f is
+   NULL. Tokens are slices of the buffer rather than copies and are only
+   valid until the next refill, which moves the unread part to the
+   start of the buffer, growing it if a token fills all of it. */
+#define READER_BUFFER_SIZE 65536
+
+typedef struct reader_t {
+  FILE *f;
+  char *buffer;
+  const char *s;
+  uint64_t start;
+  uint64_t end;
+  uint64_t size;
+  id_stack_t open;
+} reader_t;
+
+reader_t file_reader(FILE *f) {
+  char *buffer = (char*)malloc(READER_BUFFER_SIZE);
+  return (reader_t){f, buffer, buffer, 0, 0, READER_BUFFER_SIZE,
+                    {NULL, 0, 0}};
+}
+
+reader_t string_reader(const char *s) {
+  return (reader_t){NULL, NULL, s, 0, strlen(s), 0, {NULL, 0, 0}};
+}
+
+void free_reader(reader_t *r) {
+  free(r->buffer);
+  free(r->open.ids);
+}
+
+/* Returns false at the end of the input. */
+bool refill(reader_t *r) {
+  if(r->f == NULL) {
+    return false;
+  }
+  memmove(r->buffer, r->buffer + r->start, r->end - r->start);
+  r->end -= r->start;
+  r->start = 0;
+  if(r->size - r->end < 2) {
+    r->size *= 2;
+    r->buffer = (char*)realloc(r->buffer, r->size);
+    assert(r->buffer != NULL);
+    r->s = r->buffer;
+  }
+  if(fgets(r->buffer + r->end, r->size - r->end, r->f) == NULL) {
+    return false;
+  }
+  r->end += strlen(r->buffer + r->end);
+  return true;
+}
+
+bool is_delimiter(char c) {
+  return isspace((unsigned char)c) || c == '(' || c == ')';
+}
+
+/* Points token at the next token and len at its length, returning
+   false at the end of the input. */
+bool next_token(reader_t *r, const char **token, uint64_t *len) {
+  while(true) {
+    while(r->start < r->end && isspace((unsigned char)r->s[r->start])) {
+      r->start++;
+    }
+    if(r->start < r->end) {
+      break;
+    } else if(!refill(r)) {
+      return false;
+    }
+  }
+  uint64_t n = 1;
+  if(r->s[r->start] != '(' && r->s[r->start] != ')') {
+    while(true) {
+      while(r->start + n < r->end && !is_delimiter(r->s[r->start + n])) {
+        n++;
+      }
+      if(r->start + n < r->end || !refill(r)) {
+        break;
+      }
+    }
+  }
+  *token = r->s + r->start;
+  *len = n;
+  r->start += n;
+  return true;
+}
+
+/* Reads the next datum of r into res, returning false at the end of the
+   input. The elements of open lists are kept on the root stack, with
+   the depth where each list starts in r->open, and a list is made in
+   one go by list_from_stack at its closing parenthesis, so neither the
+   length nor the nesting of lists is bounded by the C stack. */
+bool read_datum(reader_t *r, typed_pointer *res) {
+  const char *token;
+  uint64_t len;
+  typed_pointer e;
+  while(next_token(r, &token, &len)) {
+    if(token[0] == '(') {
+      push_id(&r->open, heap->rused);
+      continue;
+    } else if(token[0] == ')') {
+      assert(r->open.used > 0);
+      uint64_t n = heap->rused - r->open.ids[--r->open.used];
+      push_root(empty_list);
+      e = list_from_stack(n);
+    } else {
+      e = read_atom(token, len);
+    }
+    if(r->open.used == 0) {
+      *res = e;
+      return true;
+    }
+    push_root(e);
+  }
+  assert(r->open.used == 0);
+  return false;
+}
+
+typed_pointer read_sexp(const char *s) {
+  reader_t r = string_reader(s);
+  typed_pointer res;
+  bool read = read_datum(&r, &res);
+  assert(read);
+  free_reader(&r);
+  return res;
+}
+
+char* vector_to_str(typed_pointer vector);
+
+char* atom_to_str(typed_pointer atom) {
+  char *res;
+  int size;
+  if(is_(FIXNUM, atom)) {
+    size = snprintf(NULL, 0, "%lld", (long long)fixnum_value(atom));
+    res = calloc(size+1, sizeof(char));
+    size = snprintf(res, size+1, "%lld", (long long)fixnum_value(atom));
+    return res;
+  } else if(is_bignum(atom)){
+    return integer_to_str(atom);
+  } else if(is_(SYMBOL, atom)){
+    char *s = symbol_name(symbols, atom.i & VALUE_MASK.i);
+    char *res = calloc(strlen(s)+1, sizeof(char));
+    strcpy(res, s);
+    return res;
+  } else if(is_(PRIMITIVE, atom)){
+    size = snprintf(NULL, 0, "#PRIMITIVE#%d#", (int32_t)atom.i);
+    res = calloc(size+1, sizeof(char));
+    size = snprintf(res, size+1, "#PRIMITIVE#%d#", (int32_t)atom.i);
+    return res;
+  } else if(is_object(atom, VECTOR_OBJECT) || is_packed(atom)){
+    return vector_to_str(atom);
+  } else if(is_object(atom, HASH_TABLE_OBJECT)){
+    uint64_t count = object_ref(atom, 3).i & VALUE_MASK.i;
+    size = snprintf(NULL, 0, "#HASH-TABLE#%lu#", (unsigned long)count);
+    res = calloc(size+1, sizeof(char));
+    size = snprintf(res, size+1, "#HASH-TABLE#%lu#", (unsigned long)count);
+    return res;
+  } else if(is_object(atom, BYTEVECTOR_OBJECT)){
+    uint64_t length = object_slots(atom)[2].i;
+    size = snprintf(NULL, 0, "#BYTEVECTOR#%lu#", (unsigned long)length);
+    res = calloc(size+1, sizeof(char));
+    size = snprintf(res, size+1, "#BYTEVECTOR#%lu#", (unsigned long)length);
+    return res;
+  } else if(is_(OBJECT, atom)){
+    return atom_to_str(is_object(atom, CLOSURE_OBJECT) ?
+                       procedure_symbol : record_symbol);
+  } else {
+    size = snprintf(NULL, 0, "%f", atom.f);
+    res = calloc(size+1, sizeof(char));
+    size = snprintf(res, size+1, "%f", atom.f);
+    return res;
+  }
+}
+
+uint64_t pused = 0;
+uint64_t psize = 1024;
+typed_pointer parents[1024];
+
+void push(typed_pointer p) {
+  assert(pused < psize);
+  parents[pused++] = p;
+}
+
+void pop() {
+  pused--;
+}
+
+bool contains(typed_pointer p) {
+  for(uint64_t i = 0; i < pused; i++) {
+    if(eq(parents[i], p)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+char* pair_to_str(typed_pointer pair) {
+  char *res[5] = {"", "", "", "", ""};
+  char *s;
+  if(contains(pair)) {
+    s = calloc(5, sizeof(char));
+    s[0] = '.';
+    s[1] = '.';
+    s[2] = '.';
+    s[3] = ')';
+    return s;
+  }
+  
+  if(is_(PAIR, car(pair))) {
+    res[0] = "(";
+    push(pair);
+    res[1] = pair_to_str(car(pair));
+    pop();
+  } else {
+    res[1] = atom_to_str(car(pair));
+  }
+ 
+  if(is_(PAIR, cdr(pair))) {
+    res[2] = " ";
+    push(pair);
+    res[3] = pair_to_str(cdr(pair));
+    pop();
+    s = result_cat(res);
+    free(res[3]);
+  } else if(eq(cdr(pair), empty_list)) {
+    res[2] = ")";
+    s = result_cat(res);
+  } else {
+    res[2] = " . ";
+    res[3] = atom_to_str(cdr(pair));
+    res[4] = ")";
+    s = result_cat(res);
+    free(res[3]);
+  }
+  
+  free(res[1]);
+  return s;
+}
+
+char* sexp_to_str(typed_pointer sexp);
+
+char* vector_to_str(typed_pointer vector) {
+  if(contains(vector)) {
+    char *s = calloc(4, sizeof(char));
+    strcpy(s, "...");
+    return s;
+  }
+  const char *open = is_object(vector, F64VECTOR_OBJECT) ? "#f64(" :
+    is_object(vector, I64VECTOR_OBJECT) ? "#i64(" : "#(";
+  uint64_t n = object_size(vector), len = strlen(open) + 2;
+  char **items = (char**)malloc(sizeof(char*) * (n + 1));
+  push(vector);
+  for(uint64_t k = 0; k < n; k++) {
+    if(is_object(vector, I64VECTOR_OBJECT)) {
+      /* Boxing could make a bignum, and printing must not allocate. */
+      int64_t x = (int64_t)packed_elements(vector)[k].i;
+      items[k] = calloc(21, sizeof(char));
+      snprintf(items[k], 21, "%lld", (long long)x);
+    } else {
+      items[k] = sexp_to_str(is_packed(vector) ? packed_ref(vector, k) :
+                             object_ref(vector, k));
+    }
+    len += strlen(items[k]) + 1;
+  }
+  pop();
+  char *res = calloc(len, sizeof(char));
+  strcat(res, open);
+  for(uint64_t k = 0; k < n; k++) {
+    if(k > 0) {
+      strcat(res, " ");
+    }
+    strcat(res, items[k]);
+    free(items[k]);
+  }
+  strcat(res, ")");
+  free(items);
+  return res;
+}
+
+char* sexp_to_str(typed_pointer sexp) {
+  if(is_(PAIR, sexp)) {
+    char *t = pair_to_str(sexp);
+    char *res = calloc(strlen(t) + 2, sizeof(char));
+    strcat(res, "(");
+    strcat(res, t);
+    free(t);
+    return res;
+  } else {
+    return atom_to_str(sexp);
+  }
+}
+
+/* EVAL */
+
+bool is_self_evaluating(typed_pointer exp) {
+  return !is_(PAIR, exp) && !is_(SYMBOL, exp);
+}
+
+bool is_variable(typed_pointer exp) {
+  return is_(SYMBOL, exp) && !eq(exp, empty_list);
+}
+
+/* Symbols are only ever looked up in globals: lexical_pass turns every
+   variable bound by a lambda into a LOCAL. */
+typed_pointer lookup_variable_value(typed_pointer var) {
+  uint64_t id = var.i & VALUE_MASK.i;
+  return id < heap->gsize ? heap->globals[id] : var_not_found;
+}
+
+bool is_quoted(typed_pointer exp) {
+  return eq(car(exp), quote_symbol);
+}
+
+typed_pointer text_of_quotation(typed_pointer exp) {
+  return car(cdr(exp));
+}
+
+bool is_assignment(typed_pointer exp) {
+  return eq(car(exp), set_symbol);
+}
+
+typed_pointer assignment_var(typed_pointer exp) {
+  return car(cdr(exp));
+}
+
+typed_pointer assignment_val(typed_pointer exp) {
+  return car(cdr(cdr(exp)));
+}
+
+/* A global that already holds a nursery pointer is on gdirty, since no
+   global holds one right after a collection. */
+void global_barrier(uint64_t id, typed_pointer val) {
+  if(is_young(val) && !is_young(heap->globals[id])) {
+    push_id(&heap->gdirty, id);
+  }
+  symbol_barrier(val);
+}
+
+typed_pointer set_var_val(typed_pointer var, typed_pointer val) {
+  uint64_t id = var.i & VALUE_MASK.i;
+  if(id >= heap->gsize || eq(heap->globals[id], var_not_found)) {
+    return var_not_found;
+  }
+  global_barrier(id, val);
+  heap->globals[id] = val;
+  return val;
+}
+
+bool is_definition(typed_pointer exp) {
+  return eq(car(exp), define_symbol);
+}
+
+typed_pointer def_var(typed_pointer exp) {
+  if(!is_(PAIR, car(cdr(exp)))) {
+    return car(cdr(exp));
+  } else {
+    return car(car(cdr(exp)));
+  }
+}
+
+typed_pointer make_lambda(typed_pointer formals, typed_pointer body) {
+  return cons(lambda_symbol, cons(formals, body));
+}
+
+bool is_lambda(typed_pointer exp) {
+  return eq(car(exp), lambda_symbol);
+}
+
+typed_pointer lambda_parameters(typed_pointer exp) {
+  return car(cdr(exp));
+}
+
+typed_pointer lambda_body(typed_pointer exp) {
+  return cdr(cdr(exp));
+}
+
+typed_pointer def_val(typed_pointer exp) {
+  if(!is_(PAIR, car(cdr(exp)))) {
+    return car(cdr(cdr(exp)));
+  } else {
+    return make_lambda(cdr(car(cdr(exp))), cdr(cdr(exp)));
+  }
+}
+
+typed_pointer define_var(typed_pointer var, typed_pointer val) {
+  uint64_t id = var.i & VALUE_MASK.i;
+  if(id >= heap->gsize) {
+    uint64_t size = heap->gsize < 64 ? 64 : heap->gsize;
+    while(size <= id) {
+      size *= 2;
+    }
+    heap->globals = (typed_pointer*)realloc(heap->globals,
+                                            sizeof(typed_pointer) * size);
+    for(uint64_t k = heap->gsize; k < size; k++) {
+      heap->globals[k] = var_not_found;
+    }
+    heap->gsize = size;
+  }
+  symbol_barrier(var);
+  global_barrier(id, val);
+  heap->globals[id] = val;
+  return val;
+}
+
+bool is_if(typed_pointer exp) {
+  return eq(car(exp), if_symbol);
+}
+
+typed_pointer if_predicate(typed_pointer exp) {
+  return car(cdr(exp));
+}
+
+typed_pointer if_consequent(typed_pointer exp) {
+  return car(cdr(cdr(exp)));
+}
+
+typed_pointer if_alternative(typed_pointer exp) {
+  return car(cdr(cdr(cdr(exp))));
+}
+
+bool is_application(typed_pointer exp) {
+  return is_(PAIR, exp);
+}
+
+/* LEXICAL ADDRESSING */
+
+/* The first time a lambda is evaluated, lexical_pass rewrites it so that
+   every reference to a variable it or an enclosing lambda binds is a
+   LOCAL holding the variable's depth, the number of frames to go up,
+   and its index in that frame. The symbols left are globals. The lambda
+   becomes (#LAMBDA# arity size . body), its frame holding the arity
+   parameters followed by the variables defined in its body.
+   Calls build that frame as a FRAME_OBJECT whose slot 0 is the
+   enclosing environment, so a LOCAL is reached without comparing any
+   names. Every chain ends in (), globals being looked up by symbol id
+   instead. */
+typed_pointer make_local(uint64_t depth, uint64_t index) {
+  return make_(LOCAL, depth << 32 | index);
+}
+
+uint64_t local_depth(typed_pointer local) {
+  return (local.i & VALUE_MASK.i) >> 32;
+}
+
+uint64_t local_index(typed_pointer local) {
+  return local.i & 0xFFFFFFFF;
+}
+
+typed_pointer local_frame(typed_pointer local, typed_pointer env) {
+  for(uint64_t depth = local_depth(local); depth > 0; depth--) {
+    env = object_ref(env, 0);
+  }
+  return env;
+}
+
+typed_pointer local_value(typed_pointer local, typed_pointer env) {
+  return object_ref(local_frame(local, env), local_index(local) + 1);
+}
+
+void set_local(typed_pointer local, typed_pointer val, typed_pointer env) {
+  object_set(local_frame(local, env), local_index(local) + 1, val);
+}
+
+bool is_lexical_lambda(typed_pointer exp) {
+  return eq(car(exp), lexical_lambda_symbol);
+}
+
+/* var as a LOCAL if scope, a list of the names in each enclosing frame
+   from the innermost out, binds it. */
+typed_pointer lexical_address(typed_pointer var, typed_pointer scope) {
+  for(uint64_t depth = 0; !eq(scope, empty_list); depth++) {
+    uint64_t index = 0;
+    for(typed_pointer names = car(scope); !eq(names, empty_list);
+        names = cdr(names)) {
+      if(eq(car(names), var)) {
+        return make_local(depth, index);
+      }
+      index++;
+    }
+    scope = cdr(scope);
+  }
+  return var;
+}
+
+/* Pushes the names exp defines outside of any lambda it holds, unless
+   they are already on the root stack above scope. */
+void push_defined_names(typed_pointer exp, uint64_t scope) {
+  if(!is_(PAIR, exp) || is_quoted(exp) || is_lambda(exp) ||
+     is_lexical_lambda(exp)) {
+    return;
+  }
+  if(is_definition(exp)) {
+    typed_pointer var = def_var(exp);
+    uint64_t k = scope;
+    while(k < heap->rused && !eq(heap->gc_roots[k], var)) {
+      k++;
+    }
+    if(k == heap->rused) {
+      push_root(var);
+    }
+    if(is_(PAIR, car(cdr(exp)))) {
+      return;
+    }
+    exp = cdr(exp);
+  }
+  for(; is_(PAIR, exp); exp = cdr(exp)) {
+    push_defined_names(car(exp), scope);
+  }
+}
+
+/* The parameters followed by the names defined in body. A define inside
+   an if or an operand binds in the frame as well, like one at the top
+   of the body, rather than making a global. */
+typed_pointer frame_names(typed_pointer params, typed_pointer body) {
+  uint64_t scope = enter_scope();
+  for(; is_(PAIR, params); params = cdr(params)) {
+    push_root(car(params));
+  }
+  for(; is_(PAIR, body); body = cdr(body)) {
+    push_defined_names(car(body), scope);
+  }
+  typed_pointer names = empty_list;
+  while(heap->rused > scope) {
+    names = cons(pop_root(), names);
+  }
+  leave_scope(scope);
+  return names;
+}
+
+uint64_t list_length(typed_pointer list) {
+  uint64_t n = 0;
+  for(; is_(PAIR, list); list = cdr(list)) {
+    n++;
+  }
+  return n;
+}
+
+typed_pointer lexical_pass(typed_pointer exp, typed_pointer scope);
+
+typed_pointer lexical_pass_list(typed_pointer exps, typed_pointer scope) {
+  if(!is_(PAIR, exps)) {
+    return exps;
+  }
+  uint64_t s = enter_scope();
+  handle hexps = make_handle(exps), hscope = make_handle(scope);
+  handle hfirst = make_handle(lexical_pass(car(exps), scope));
+  typed_pointer rest = lexical_pass_list(cdr(handle_ref(hexps)),
+                                         handle_ref(hscope));
+  typed_pointer res = cons(handle_ref(hfirst), rest);
+  leave_scope(s);
+  return res;
+}
+
+typed_pointer lexical_lambda(typed_pointer exp, typed_pointer scope) {
+  uint64_t s = enter_scope();
+  handle hexp = make_handle(exp), hscope = make_handle(scope);
+  typed_pointer names = frame_names(lambda_parameters(exp), lambda_body(exp));
+  uint64_t size = list_length(names);
+  uint64_t arity = list_length(lambda_parameters(handle_ref(hexp)));
+  typed_pointer inner = cons(names, handle_ref(hscope));
+  typed_pointer res = lexical_pass_list(lambda_body(handle_ref(hexp)), inner);
+  res = cons(make_(FIXNUM, size), res);
+  res = cons(make_(FIXNUM, arity), res);
+  res = cons(lexical_lambda_symbol, res);
+  leave_scope(s);
+  return res;
+}
+
+/* (head var val) with var addressed and val rewritten, for set! and
+   define. */
+typed_pointer lexical_binding(typed_pointer head, typed_pointer var,
+                              typed_pointer val, typed_pointer scope) {
+  uint64_t s = enter_scope();
+  handle hvar = make_handle(var), hscope = make_handle(scope);
+  typed_pointer res = cons(lexical_pass(val, scope), empty_list);
+  res = cons(lexical_address(handle_ref(hvar), handle_ref(hscope)), res);
+  res = cons(head, res);
+  leave_scope(s);
+  return res;
+}
+
+typed_pointer lexical_pass(typed_pointer exp, typed_pointer scope) {
+  if(is_variable(exp)) {
+    return lexical_address(exp, scope);
+  } else if(!is_(PAIR, exp) || is_quoted(exp) || is_lexical_lambda(exp)) {
+    return exp;
+  } else if(is_lambda(exp)) {
+    return lexical_lambda(exp, scope);
+  } else if(is_assignment(exp)) {
+    return lexical_binding(set_symbol, assignment_var(exp),
+                           assignment_val(exp), scope);
+  } else if(is_definition(exp)) {
+    uint64_t s = enter_scope();
+    handle hexp = make_handle(exp), hscope = make_handle(scope);
+    typed_pointer val = def_val(exp);
+    exp = lexical_binding(define_symbol, def_var(handle_ref(hexp)), val,
+                          handle_ref(hscope));
+    leave_scope(s);
+    return exp;
+  } else if(is_if(exp)) {
+    push_root(exp);
+    typed_pointer rest = lexical_pass_list(cdr(exp), scope);
+    return cons(car(pop_root()), rest);
+  } else {
+    return lexical_pass_list(exp, scope);
+  }
+}
+
+/* The body is either the list of expressions of an analyzed lambda or
+   the CODE_OBJECT it was compiled to. The size of a compiled closure
+   whose frame no other closure can capture is marked STACK_FRAME: its
+   frame lives on the root stack rather than in the heap. */
+#define STACK_FRAME ((uint64_t)1 << 32)
+
+typed_pointer make_closure(typed_pointer arity, typed_pointer size,
+                           typed_pointer body, typed_pointer env) {
+  push_root(env);
+  push_root(body);
+  typed_pointer proc = make_object(CLOSURE_OBJECT, 4);
+  object_set(proc, 0, arity);
+  object_set(proc, 1, size);
+  object_set(proc, 2, pop_root());
+  object_set(proc, 3, pop_root());
+  return proc;
+}
+
+typed_pointer make_procedure(typed_pointer lambda, typed_pointer env) {
+  push_root(env);
+  typed_pointer body = cdr(cdr(cdr(lambda)));
+  return make_closure(car(cdr(lambda)), car(cdr(cdr(lambda))), body,
+                      pop_root());
+}
+
+bool is_procedure(typed_pointer exp) {
+  return is_object(exp, CLOSURE_OBJECT);
+}
+
+uint64_t procedure_arity(typed_pointer exp) {
+  return object_ref(exp, 0).i & VALUE_MASK.i;
+}
+
+uint64_t procedure_frame_size(typed_pointer exp) {
+  return object_ref(exp, 1).i & VALUE_MASK.i & ~STACK_FRAME;
+}
+
+bool has_stack_frame(typed_pointer exp) {
+  return object_ref(exp, 1).i & STACK_FRAME;
+}
+
+typed_pointer procedure_body(typed_pointer exp) {
+  return object_ref(exp, 2);
+}
+
+typed_pointer procedure_env(typed_pointer exp) {
+  return object_ref(exp, 3);
+}
+
+typed_pointer operator(typed_pointer exp) {
+  return car(exp);
+}
+
+typed_pointer operands(typed_pointer exp) {
+  return cdr(exp);
+}
+
+bool has_operands(typed_pointer ops) {
+  return !eq(ops, empty_list);
+}
+
+typed_pointer first_operand(typed_pointer ops) {
+  return car(ops);
+}
+
+typed_pointer rest_operands(typed_pointer ops) {
+  return cdr(ops);
+}
+
+typed_pointer tree_eval(typed_pointer exp, typed_pointer env);
+typed_pointer call(uint64_t n);
+
+typed_pointer eval_sequence(typed_pointer exps, typed_pointer env) {
+  if(eq(cdr(exps), empty_list)) {
+    return tree_eval(car(exps), env);
+  }
+  uint64_t scope = enter_scope();
+  handle hexps = make_handle(exps), henv = make_handle(env);
+  while(!eq(cdr(exps), empty_list)) {
+    handle_set(hexps, cdr(exps));
+    tree_eval(car(exps), env);
+    exps = handle_ref(hexps);
+    env = handle_ref(henv);
+  }
+  leave_scope(scope);
+  return tree_eval(car(exps), env);
+}
+
+bool is_compiled_closure(typed_pointer op_val) {
+  return is_procedure(op_val) &&
+    is_object(procedure_body(op_val), CODE_OBJECT);
+}
+
+/* Pops the procedure below the n arguments on top of the stack and
+   them, returning a frame binding them and setting body to the
+   procedure's. Missing arguments, like the variables the body has yet
+   to define, read as #VAR-NOT-FOUND#. */
+typed_pointer closure_frame(uint64_t n, typed_pointer *body) {
+  typed_pointer op_val = heap->gc_roots[heap->rused - n - 1];
+  uint64_t arity = procedure_arity(op_val);
+  uint64_t size = procedure_frame_size(op_val);
+  typed_pointer frame = make_object(FRAME_OBJECT, size + 1);
+  typed_pointer *args = &heap->gc_roots[heap->rused - n];
+  op_val = args[-1];
+  object_set(frame, 0, procedure_env(op_val));
+  for(uint64_t k = 0; k < size; k++) {
+    object_set(frame, k + 1, k < arity && k < n ? args[k] : var_not_found);
+  }
+  *body = procedure_body(op_val);
+  heap->rused -= n + 1;
+  return frame;
+}
+
+/* PRIMITIVES */
+
+/* A PRIMITIVE's payload indexes primitives. Its function gets a handle
+   to the first of its n arguments, which are on the root stack, so
+   they stay rooted and are read afresh after allocating, as
+   handle_ref(args + k). arity is the number of arguments it takes, or
+   VARIADIC(k) if it takes k or more; a call with any other number
+   returns #WRONG-ARITY#. */
+typedef typed_pointer (*primitive_fn)(handle args, uint64_t n);
+
+typedef struct primitive_t {
+  primitive_fn fn;
+  int64_t arity;
+} primitive_t;
+
+#define VARIADIC(k) (-(int64_t)(k) - 1)
+
+primitive_t *primitives = NULL;
+uint64_t nprimitives = 0;
+uint64_t sprimitives = 0;
+
+/* Binds name to a new primitive calling fn, which it returns. */
+typed_pointer register_primitive(const char *name, primitive_fn fn,
+                                 int64_t arity) {
+  if(nprimitives == sprimitives) {
+    sprimitives = sprimitives == 0 ? 16 : 2 * sprimitives;
+    primitives = (primitive_t*)realloc(primitives,
+                                       sizeof(primitive_t) * sprimitives);
+  }
+  primitives[nprimitives] = (primitive_t){fn, arity};
+  typed_pointer p = make_(PRIMITIVE, nprimitives++);
+  define_var(insert_symbol((char*)name), p);
+  return p;
+}
+
+/* Calls the primitive below the n arguments on top of the stack,
+   popping all of them. */
+typed_pointer call_primitive(uint64_t n) {
+  typed_pointer op_val = heap->gc_roots[heap->rused - n - 1];
+  typed_pointer val = op_not_found;
+  if(is_(PRIMITIVE, op_val)) {
+    primitive_t *p = &primitives[op_val.i & VALUE_MASK.i];
+    if((int64_t)n == p->arity || (p->arity < 0 && (int64_t)n >= -p->arity - 1)) {
+      val = p->fn(heap->rused - n, n);
+    } else {
+      val = wrong_arity;
+    }
+  }
+  heap->rused -= n + 1;
+  return val;
+}
+
+/* Applies the primitive op_val to the list ops_vals. */
+typed_pointer primitive_apply(typed_pointer op_val, typed_pointer ops_vals) {
+  push_root(op_val);
+  uint64_t n = 0;
+  for(; is_(PAIR, ops_vals); n++) {
+    push_root(car(ops_vals));
+    ops_vals = cdr(ops_vals);
+  }
+  return call_primitive(n);
+}
+
+typed_pointer prim_cons(handle args, uint64_t n) {
+  return cons(handle_ref(args), handle_ref(args + 1));
+}
+
+/* Fixnum operands take the fast path: the sum or difference of two
+   48-bit values cannot overflow 64 bits, so one range check on the
+   result decides whether it is a fixnum. */
+typed_pointer prim_add(handle args, uint64_t n) {
+  typed_pointer x = handle_ref(args), y = handle_ref(args + 1);
+  if(is_(FIXNUM, x) && is_(FIXNUM, y)) {
+    return make_integer(fixnum_value(x) + fixnum_value(y));
+  }
+  return integer_add(x, y, false);
+}
+
+typed_pointer prim_sub(handle args, uint64_t n) {
+  typed_pointer x = handle_ref(args), y = handle_ref(args + 1);
+  if(is_(FIXNUM, x) && is_(FIXNUM, y)) {
+    return make_integer(fixnum_value(x) - fixnum_value(y));
+  }
+  return integer_add(x, y, true);
+}
+
+typed_pointer prim_mult(handle args, uint64_t n) {
+  typed_pointer x = handle_ref(args), y = handle_ref(args + 1);
+  int64_t r;
+  if(is_(FIXNUM, x) && is_(FIXNUM, y) &&
+     !__builtin_mul_overflow(fixnum_value(x), fixnum_value(y), &r)) {
+    return make_integer(r);
+  }
+  return integer_mul(x, y);
+}
+
+typed_pointer prim_eq(handle args, uint64_t n) {
+  return eq(handle_ref(args), handle_ref(args + 1)) ? true_symbol :
+    false_symbol;
+}
+
+/* (make-vector size [fill]) */
+typed_pointer prim_make_vector(handle args, uint64_t n) {
+  typed_pointer size = handle_ref(args);
+  if(!is_(FIXNUM, size) || fixnum_value(size) < 0) {
+    return wrong_type;
+  }
+  typed_pointer vector = make_object(VECTOR_OBJECT, fixnum_value(size));
+  if(n > 1) {
+    for(uint64_t k = 0; k < object_size(vector); k++) {
+      object_set(vector, k, handle_ref(args + 1));
+    }
+  }
+  return vector;
+}
+
+typed_pointer prim_vector_ref(handle args, uint64_t n) {
+  if(is_packed(handle_ref(args))) {
+    return packed_ref(handle_ref(args), fixnum_value(handle_ref(args + 1)));
+  }
+  return object_ref(handle_ref(args), fixnum_value(handle_ref(args + 1)));
+}
+
+typed_pointer prim_vector_set(handle args, uint64_t n) {
+  if(is_packed(handle_ref(args))) {
+    if(!packed_set(handle_ref(args), fixnum_value(handle_ref(args + 1)),
+                   handle_ref(args + 2))) {
+      return wrong_type;
+    }
+    return handle_ref(args + 2);
+  }
+  object_set(handle_ref(args), fixnum_value(handle_ref(args + 1)),
+             handle_ref(args + 2));
+  return handle_ref(args + 2);
+}
+
+typed_pointer prim_vector_length(handle args, uint64_t n) {
+  return make_(FIXNUM, object_size(handle_ref(args)));
+}
+
+typed_pointer prim_gensym(handle args, uint64_t n) {
+  return gensym();
+}
+
+
+/* A packed vector of kind and size elements, all zero. */
+typed_pointer make_packed(uint64_t kind, uint64_t size) {
+  typed_pointer vector = make_object(kind, size);
+  memset(packed_elements(vector), 0, sizeof(typed_pointer) * size);
+  return vector;
+}
+
+/* The arithmetic on packed vectors runs through two kernels, one
+   mapping element-wise and one reducing, with SSE2 and AVX2 versions of
+   each; simd picks the widest the processor has. Integers wrap
+   around. */
+enum {
+  PACKED_ADD,
+  PACKED_SUB,
+  PACKED_MUL,
+  PACKED_SCALE,
+  PACKED_SUM,
+  PACKED_DOT,
+  PACKED_MIN,
+  PACKED_MAX
+};
+
+enum {
+  SIMD_SCALAR,
+  SIMD_SSE2,
+  SIMD_AVX2
+};
+
+int simd = SIMD_SCALAR;
+
+/* r[k] = a[k] op b[k], or a[k] * b[0] for PACKED_SCALE. */
+void packed_map_scalar(int op, bool f64, typed_pointer *r,
+                       const typed_pointer *a, const typed_pointer *b,
+                       uint64_t n) {
+  for(uint64_t k = 0; k < n; k++) {
+    typed_pointer x = a[k], y = op == PACKED_SCALE ? b[0] : b[k];
+    if(f64) {
+      r[k].f = op == PACKED_ADD ? x.f + y.f :
+        op == PACKED_SUB ? x.f - y.f : x.f * y.f;
+    } else {
+      r[k].i = op == PACKED_ADD ? x.i + y.i :
+        op == PACKED_SUB ? x.i - y.i : x.i * y.i;
+    }
+  }
+}
+
+typed_pointer packed_combine(int op, bool f64, typed_pointer x,
+                             typed_pointer y) {
+  if(op == PACKED_MIN || op == PACKED_MAX) {
+    bool less = f64 ? y.f < x.f : (int64_t)y.i < (int64_t)x.i;
+    return less == (op == PACKED_MIN) ? y : x;
+  } else if(f64) {
+    x.f += y.f;
+  } else {
+    x.i += y.i;
+  }
+  return x;
+}
+
+/* Folds a, or the products of a and b for PACKED_DOT, into acc. */
+typed_pointer packed_reduce_scalar(int op, bool f64, typed_pointer acc,
+                                   const typed_pointer *a,
+                                   const typed_pointer *b, uint64_t n) {
+  for(uint64_t k = 0; k < n; k++) {
+    typed_pointer x = a[k];
+    if(op == PACKED_DOT && f64) {
+      x.f *= b[k].f;
+    } else if(op == PACKED_DOT) {
+      x.i *= b[k].i;
+    }
+    acc = packed_combine(op, f64, acc, x);
+  }
+  return acc;
+}
+
+#if defined(__x86_64__)
+
+/* Neither SSE2 nor AVX2 has a 64-bit multiply, so these build the low
+   half of one out of 32-bit ones. */
+__m128i sse2_mul_epi64(__m128i x, __m128i y) {
+  __m128i cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(x, 32), y),
+                                _mm_mul_epu32(x, _mm_srli_epi64(y, 32)));
+  return _mm_add_epi64(_mm_mul_epu32(x, y), _mm_slli_epi64(cross, 32));
+}
+
+void packed_map_sse2(int op, bool f64, typed_pointer *r,
+                     const typed_pointer *a, const typed_pointer *b,
+                     uint64_t n) {
+  uint64_t k = 0;
+  for(; k + 2 <= n; k += 2) {
+    const typed_pointer *y = op == PACKED_SCALE ? b : b + k;
+    if(f64) {
+      __m128d u = _mm_loadu_pd(&a[k].f);
+      __m128d v = op == PACKED_SCALE ? _mm_set1_pd(b[0].f) :
+        _mm_loadu_pd(&y->f);
+      u = op == PACKED_ADD ? _mm_add_pd(u, v) :
+        op == PACKED_SUB ? _mm_sub_pd(u, v) : _mm_mul_pd(u, v);
+      _mm_storeu_pd(&r[k].f, u);
+    } else {
+      __m128i u = _mm_loadu_si128((const __m128i*)&a[k]);
+      __m128i v = op == PACKED_SCALE ? _mm_set1_epi64x(b[0].i) :
+        _mm_loadu_si128((const __m128i*)y);
+      u = op == PACKED_ADD ? _mm_add_epi64(u, v) :
+        op == PACKED_SUB ? _mm_sub_epi64(u, v) : sse2_mul_epi64(u, v);
+      _mm_storeu_si128((__m128i*)&r[k], u);
+    }
+  }
+  packed_map_scalar(op, f64, r + k, a + k, op == PACKED_SCALE ? b : b + k,
+                    n - k);
+}
+
+/* SSE2 cannot compare 64-bit integers, so their minimum and maximum
+   are left to the scalar loop. */
+typed_pointer packed_reduce_sse2(int op, bool f64, typed_pointer acc,
+                                 const typed_pointer *a,
+                                 const typed_pointer *b, uint64_t n) {
+  uint64_t k = 0;
+  bool extreme = op == PACKED_MIN || op == PACKED_MAX;
+  if(n >= 2 && f64) {
+    __m128d sum = extreme ? _mm_loadu_pd(&a[0].f) : _mm_setzero_pd();
+    for(; k + 2 <= n; k += 2) {
+      __m128d x = _mm_loadu_pd(&a[k].f);
+      if(op == PACKED_DOT) {
+        x = _mm_mul_pd(x, _mm_loadu_pd(&b[k].f));
+      }
+      sum = op == PACKED_MIN ? _mm_min_pd(sum, x) :
+        op == PACKED_MAX ? _mm_max_pd(sum, x) : _mm_add_pd(sum, x);
+    }
+    typed_pointer lanes[2];
+    _mm_storeu_pd(&lanes[0].f, sum);
+    acc = packed_reduce_scalar(extreme ? op : PACKED_SUM, f64, acc, lanes,
+                               lanes, 2);
+  } else if(n >= 2 && !extreme) {
+    __m128i sum = _mm_setzero_si128();
+    for(; k + 2 <= n; k += 2) {
+      __m128i x = _mm_loadu_si128((const __m128i*)&a[k]);
+      if(op == PACKED_DOT) {
+        x = sse2_mul_epi64(x, _mm_loadu_si128((const __m128i*)&b[k]));
+      }
+      sum = _mm_add_epi64(sum, x);
+    }
+    typed_pointer lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, sum);
+    acc = packed_reduce_scalar(PACKED_SUM, f64, acc, lanes, lanes, 2);
+  }
+  return packed_reduce_scalar(op, f64, acc, a + k, b + k, n - k);
+}
+
+__attribute__((target("avx2")))
+__m256i avx2_mul_epi64(__m256i x, __m256i y) {
+  __m256i cross = _mm256_add_epi64(
+    _mm256_mul_epu32(_mm256_srli_epi64(x, 32), y),
+    _mm256_mul_epu32(x, _mm256_srli_epi64(y, 32)));
+  return _mm256_add_epi64(_mm256_mul_epu32(x, y),
+                          _mm256_slli_epi64(cross, 32));
+}
+
+__attribute__((target("avx2")))
+void packed_map_avx2(int op, bool f64, typed_pointer *r,
+                     const typed_pointer *a, const typed_pointer *b,
+                     uint64_t n) {
+  uint64_t k = 0;
+  for(; k + 4 <= n; k += 4) {
+    const typed_pointer *y = op == PACKED_SCALE ? b : b + k;
+    if(f64) {
+      __m256d u = _mm256_loadu_pd(&a[k].f);
+      __m256d v = op == PACKED_SCALE ? _mm256_set1_pd(b[0].f) :
+        _mm256_loadu_pd(&y->f);
+      u = op == PACKED_ADD ? _mm256_add_pd(u, v) :
+        op == PACKED_SUB ? _mm256_sub_pd(u, v) : _mm256_mul_pd(u, v);
+      _mm256_storeu_pd(&r[k].f, u);
+    } else {
+      __m256i u = _mm256_loadu_si256((const __m256i*)&a[k]);
+      __m256i v = op == PACKED_SCALE ? _mm256_set1_epi64x(b[0].i) :
+        _mm256_loadu_si256((const __m256i*)y);
+      u = op == PACKED_ADD ? _mm256_add_epi64(u, v) :
+        op == PACKED_SUB ? _mm256_sub_epi64(u, v) : avx2_mul_epi64(u, v);
+      _mm256_storeu_si256((__m256i*)&r[k], u);
+    }
+  }
+  packed_map_scalar(op, f64, r + k, a + k, op == PACKED_SCALE ? b : b + k,
+                    n - k);
+}
+
+__attribute__((target("avx2")))
+typed_pointer packed_reduce_avx2(int op, bool f64, typed_pointer acc,
+                                 const typed_pointer *a,
+                                 const typed_pointer *b, uint64_t n) {
+  uint64_t k = 0;
+  bool extreme = op == PACKED_MIN || op == PACKED_MAX;
+  if(n >= 4 && f64) {
+    __m256d sum = extreme ? _mm256_loadu_pd(&a[0].f) : _mm256_setzero_pd();
+    for(; k + 4 <= n; k += 4) {
+      __m256d x = _mm256_loadu_pd(&a[k].f);
+      if(op == PACKED_DOT) {
+        x = _mm256_mul_pd(x, _mm256_loadu_pd(&b[k].f));
+      }
+      sum = op == PACKED_MIN ? _mm256_min_pd(sum, x) :
+        op == PACKED_MAX ? _mm256_max_pd(sum, x) : _mm256_add_pd(sum, x);
+    }
+    typed_pointer lanes[4];
+    _mm256_storeu_pd(&lanes[0].f, sum);
+    acc = packed_reduce_scalar(extreme ? op : PACKED_SUM, f64, acc, lanes,
+                               lanes, 4);
+  } else if(n >= 4) {
+    __m256i sum = extreme ? _mm256_loadu_si256((const __m256i*)a) :
+      _mm256_setzero_si256();
+    for(; k + 4 <= n; k += 4) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)&a[k]);
+      if(op == PACKED_DOT) {
+        x = avx2_mul_epi64(x, _mm256_loadu_si256((const __m256i*)&b[k]));
+      }
+      if(extreme) {
+        __m256i less = _mm256_cmpgt_epi64(sum, x);
+        sum = op == PACKED_MIN ? _mm256_blendv_epi8(sum, x, less) :
+          _mm256_blendv_epi8(x, sum, less);
+      } else {
+        sum = _mm256_add_epi64(sum, x);
+      }
+    }
+    typed_pointer lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, sum);
+    acc = packed_reduce_scalar(extreme ? op : PACKED_SUM, f64, acc, lanes,
+                               lanes, 4);
+  }
+  return packed_reduce_scalar(op, f64, acc, a + k, b + k, n - k);
+}
+
+#endif
+
+void packed_map(int op, bool f64, typed_pointer *r, const typed_pointer *a,
+                const typed_pointer *b, uint64_t n) {
+#if defined(__x86_64__)
+  if(simd == SIMD_AVX2) {
+    packed_map_avx2(op, f64, r, a, b, n);
+    return;
+  } else if(simd == SIMD_SSE2) {
+    packed_map_sse2(op, f64, r, a, b, n);
+    return;
+  }
+#endif
+  packed_map_scalar(op, f64, r, a, b, n);
+}
+
+typed_pointer packed_reduce(int op, bool f64, const typed_pointer *a,
+                            const typed_pointer *b, uint64_t n) {
+  typed_pointer acc = op == PACKED_MIN || op == PACKED_MAX ? a[0] :
+    (typed_pointer){.i = 0};
+#if defined(__x86_64__)
+  if(simd == SIMD_AVX2) {
+    return packed_reduce_avx2(op, f64, acc, a, b, n);
+  } else if(simd == SIMD_SSE2) {
+    return packed_reduce_sse2(op, f64, acc, a, b, n);
+  }
+#endif
+  return packed_reduce_scalar(op, f64, acc, a, b, n);
+}
+
+/* (make-f64vector size [fill]) */
+typed_pointer make_packed_vector(uint64_t kind, handle args, uint64_t n) {
+  typed_pointer size = handle_ref(args);
+  if(!is_(FIXNUM, size) || fixnum_value(size) < 0) {
+    return wrong_type;
+  }
+  typed_pointer vector = make_packed(kind, fixnum_value(size));
+  for(uint64_t k = 0; n > 1 && k < object_size(vector); k++) {
+    if(!packed_set(vector, k, handle_ref(args + 1))) {
+      return wrong_type;
+    }
+  }
+  return vector;
+}
+
+typed_pointer prim_make_f64vector(handle args, uint64_t n) {
+  return make_packed_vector(F64VECTOR_OBJECT, args, n);
+}
+
+typed_pointer prim_make_i64vector(handle args, uint64_t n) {
+  return make_packed_vector(I64VECTOR_OBJECT, args, n);
+}
+
+/* (f64vector x ...) */
+typed_pointer packed_vector(uint64_t kind, handle args, uint64_t n) {
+  typed_pointer vector = make_packed(kind, n);
+  for(uint64_t k = 0; k < n; k++) {
+    if(!packed_set(vector, k, handle_ref(args + k))) {
+      return wrong_type;
+    }
+  }
+  return vector;
+}
+
+typed_pointer prim_f64vector(handle args, uint64_t n) {
+  return packed_vector(F64VECTOR_OBJECT, args, n);
+}
+
+typed_pointer prim_i64vector(handle args, uint64_t n) {
+  return packed_vector(I64VECTOR_OBJECT, args, n);
+}
+
+/* Maps op over the two packed vectors in args, which must be of the
+   same kind and length, into a new one. */
+typed_pointer packed_binary(int op, handle args) {
+  typed_pointer a = handle_ref(args), b = handle_ref(args + 1);
+  if(!is_packed(a) || !is_packed(b) || object_kind(a) != object_kind(b) ||
+     object_size(a) != object_size(b)) {
+    return wrong_type;
+  }
+  typed_pointer r = make_packed(object_kind(a), object_size(a));
+  a = handle_ref(args);
+  b = handle_ref(args + 1);
+  packed_map(op, object_kind(a) == F64VECTOR_OBJECT, packed_elements(r),
+             packed_elements(a), packed_elements(b), object_size(a));
+  return r;
+}
+
+typed_pointer prim_vector_add(handle args, uint64_t n) {
+  return packed_binary(PACKED_ADD, args);
+}
+
+typed_pointer prim_vector_sub(handle args, uint64_t n) {
+  return packed_binary(PACKED_SUB, args);
+}
+
+typed_pointer prim_vector_mul(handle args, uint64_t n) {
+  return packed_binary(PACKED_MUL, args);
+}
+
+/* (vector-scale vector x) */
+typed_pointer prim_vector_scale(handle args, uint64_t n) {
+  typed_pointer a = handle_ref(args);
+  if(!is_packed(a)) {
+    return wrong_type;
+  }
+  typed_pointer r = make_packed(object_kind(a), object_size(a));
+  if(object_size(r) == 0) {
+    return r;
+  }
+  if(!packed_set(r, 0, handle_ref(args + 1))) {
+    return wrong_type;
+  }
+  typed_pointer x = packed_elements(r)[0];
+  a = handle_ref(args);
+  packed_map(PACKED_SCALE, object_kind(a) == F64VECTOR_OBJECT,
+             packed_elements(r), packed_elements(a), &x, object_size(a));
+  return r;
+}
+
+/* Reduces the packed vector in args, boxing the result. Only sum and
+   dot are defined on empty vectors. */
+typed_pointer packed_reduction(int op, handle args, uint64_t n) {
+  typed_pointer a = handle_ref(args), b = handle_ref(args + n - 1);
+  if(!is_packed(a) || !is_packed(b) || object_kind(a) != object_kind(b) ||
+     object_size(a) != object_size(b) ||
+     (object_size(a) == 0 && op != PACKED_SUM && op != PACKED_DOT)) {
+    return wrong_type;
+  }
+  bool f64 = object_kind(a) == F64VECTOR_OBJECT;
+  typed_pointer r = packed_reduce(op, f64, packed_elements(a),
+                                  packed_elements(b), object_size(a));
+  if(!f64) {
+    return make_integer((int64_t)r.i);
+  }
+  return isnan(r.f) ? packed_nan : r;
+}
+
+typed_pointer prim_vector_sum(handle args, uint64_t n) {
+  return packed_reduction(PACKED_SUM, args, n);
+}
+
+typed_pointer prim_vector_dot(handle args, uint64_t n) {
+  return packed_reduction(PACKED_DOT, args, n);
+}
+
+typed_pointer prim_vector_min(handle args, uint64_t n) {
+  return packed_reduction(PACKED_MIN, args, n);
+}
+
+typed_pointer prim_vector_max(handle args, uint64_t n) {
+  return packed_reduction(PACKED_MAX, args, n);
+}
+
+/* (mmap-file path) maps the file named by the symbol path read-only
+   into a bytevector, or returns #IO-ERROR#. Pages are only read in as
+   they are touched, without read-ahead, and the mapping lives as long
+   as the bytevector. */
+typed_pointer prim_mmap_file(handle args, uint64_t n) {
+  typed_pointer path = handle_ref(args);
+  if(!is_(SYMBOL, path)) {
+    return wrong_type;
+  }
+  int fd = open(symbol_name(symbols, path.i & VALUE_MASK.i), O_RDONLY);
+  struct stat st;
+  if(fd < 0) {
+    return io_error;
+  } else if(fstat(fd, &st) != 0) {
+    close(fd);
+    return io_error;
+  }
+  void *address = NULL;
+  uint64_t length = st.st_size;
+  if(length > 0) {
+    address = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if(address == MAP_FAILED) {
+    return io_error;
+  } else if(length > 0) {
+    madvise(address, length, MADV_RANDOM);
+  }
+  typed_pointer bytevector = make_large_object(BYTEVECTOR_OBJECT, 2);
+  object_slots(bytevector)[1].i = (uint64_t)address;
+  object_slots(bytevector)[2].i = length;
+  return bytevector;
+}
+
+/* The byte offset e of a width byte load from bytevector, a fixnum or
+   a whole double. Returns NULL when it is not one or the load would
+   not fit. */
+const uint8_t* bytevector_at(typed_pointer bytevector, typed_pointer e,
+                             uint64_t width) {
+  uint64_t offset;
+  if(!is_object(bytevector, BYTEVECTOR_OBJECT)) {
+    return NULL;
+  } else if(is_(FIXNUM, e) && fixnum_value(e) >= 0) {
+    offset = (uint64_t)fixnum_value(e);
+  } else if(is_float(e) && e.f >= 0 && e.f == floor(e.f) && e.f < 0x1p63) {
+    offset = (uint64_t)e.f;
+  } else {
+    return NULL;
+  }
+  uint64_t length = object_slots(bytevector)[2].i;
+  if(offset > length || length - offset < width) {
+    return NULL;
+  }
+  return (const uint8_t*)object_slots(bytevector)[1].i + offset;
+}
+
+typed_pointer prim_bytevector_length(handle args, uint64_t n) {
+  typed_pointer bytevector = handle_ref(args);
+  if(!is_object(bytevector, BYTEVECTOR_OBJECT)) {
+    return wrong_type;
+  }
+  return make_integer((int64_t)object_slots(bytevector)[2].i);
+}
+
+/* The loads read native-endian values at any alignment and allocate
+   nothing, but for 64-bit integers outside the fixnum range. */
+typed_pointer prim_bytevector_u8_ref(handle args, uint64_t n) {
+  const uint8_t *p = bytevector_at(handle_ref(args), handle_ref(args + 1), 1);
+  return p == NULL ? wrong_type : make_(FIXNUM, *p);
+}
+
+typed_pointer prim_bytevector_i32_ref(handle args, uint64_t n) {
+  const uint8_t *p = bytevector_at(handle_ref(args), handle_ref(args + 1), 4);
+  int32_t x;
+  if(p == NULL) {
+    return wrong_type;
+  }
+  memcpy(&x, p, sizeof(x));
+  return make_(FIXNUM, (uint64_t)(int64_t)x);
+}
+
+typed_pointer prim_bytevector_i64_ref(handle args, uint64_t n) {
+  const uint8_t *p = bytevector_at(handle_ref(args), handle_ref(args + 1), 8);
+  int64_t x;
+  if(p == NULL) {
+    return wrong_type;
+  }
+  memcpy(&x, p, sizeof(x));
+  return make_integer(x);
+}
+
+typed_pointer prim_bytevector_f64_ref(handle args, uint64_t n) {
+  const uint8_t *p = bytevector_at(handle_ref(args), handle_ref(args + 1), 8);
+  typed_pointer x;
+  if(p == NULL) {
+    return wrong_type;
+  }
+  memcpy(&x.f, p, sizeof(x.f));
+  return isnan(x.f) ? packed_nan : x;
+}
+
+/* Structural equality: pairs and vectors with equal elements, and
+   packed vectors of the same kind or bignums with the same bits, are
+   equal. */
+bool equal(typed_pointer a, typed_pointer b) {
+  for(; is_(PAIR, a) && is_(PAIR, b) && !eq(a, b); a = cdr(a), b = cdr(b)) {
+    if(!equal(car(a), car(b))) {
+      return false;
+    }
+  }
+  if(eq(a, b)) {
+    return true;
+  } else if(!is_(OBJECT, a) || !is_(OBJECT, b) ||
+            object_kind(a) != object_kind(b) ||
+            object_size(a) != object_size(b)) {
+    return false;
+  } else if(is_object(a, VECTOR_OBJECT)) {
+    for(uint64_t k = 0; k < object_size(a); k++) {
+      if(!equal(object_ref(a, k), object_ref(b, k))) {
+        return false;
+      }
+    }
+    return true;
+  } else if(is_packed(a) || is_bignum(a)) {
+    return memcmp(packed_elements(a), packed_elements(b),
+                  sizeof(typed_pointer) * object_size(a)) == 0;
+  }
+  return false;
+}
+
+typed_pointer prim_equal(handle args, uint64_t n) {
+  return equal(handle_ref(args), handle_ref(args + 1)) ? true_symbol :
+    false_symbol;
+}
+
+/* HASH TABLES */
+
+/* A hash table is an object of these fields, the counts fixnums. Its
+   entries are a vector of keys each followed by its value, probed
+   linearly from the hash of the key, a power of two in length. Free
+   slots hold #EMPTY# and removed ones #DELETED#, so that probing goes
+   on past them; used counts both live and deleted slots. A table that
+   fills up gets entries twice as large but keeps the old ones, moving a
+   few slots out of them on every operation, so that growing costs no
+   pause; until they are all moved a key may be in either. eq? tables
+   hash the bits of their keys, which change when a collection moves a
+   pair or an object, so a table holding such keys rehashes them all
+   once epoch is behind the count of full collections. A minor
+   collection only moves the keys that were in the nursery, so it only
+   forces a rehash when young, the minor collection count plus one when
+   such a key was last added, is behind. equal? tables hash the
+   structure of pairs and vectors and only the kind of other objects,
+   which no collection changes. */
+enum {
+  TABLE_ENTRIES,
+  TABLE_OLD,
+  TABLE_MOVED,
+  TABLE_COUNT,
+  TABLE_USED,
+  TABLE_EQUAL,
+  TABLE_EPOCH,
+  TABLE_YOUNG,
+  TABLE_MOVABLE,
+  TABLE_FIELDS
+};
+
+#define TABLE_MIN_SLOTS 8
+#define TABLE_MOVE_STEP 4
+#define HASH_BUDGET 32
+
+uint64_t table_field(typed_pointer table, uint64_t field) {
+  return object_ref(table, field).i & VALUE_MASK.i;
+}
+
+void set_table_field(typed_pointer table, uint64_t field, uint64_t n) {
+  object_set(table, field, make_(FIXNUM, n));
+}
+
+uint64_t hash_mix(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xFF51AFD7ED558CCD;
+  x ^= x >> 33;
+  x *= 0xC4CEB9FE1A85EC53;
+  return x ^ (x >> 33);
+}
+
+/* Hashes at most budget nodes of key, in the same order for keys that
+   are equal. */
+uint64_t hash_equal(typed_pointer key, uint64_t *budget) {
+  if(*budget == 0) {
+    return 0;
+  }
+  (*budget)--;
+  uint64_t h;
+  if(is_(PAIR, key)) {
+    h = hash_equal(car(key), budget);
+    return hash_mix(h * 31 + hash_equal(cdr(key), budget));
+  } else if(!is_(OBJECT, key)) {
+    return hash_mix(key.i);
+  }
+  h = hash_mix(object_kind(key) << 40 | object_size(key));
+  for(uint64_t k = 0; k < object_size(key) && *budget > 0; k++) {
+    if(is_object(key, VECTOR_OBJECT)) {
+      h = h * 31 + hash_equal(object_ref(key, k), budget);
+    } else if(is_packed(key) || is_bignum(key)) {
+      (*budget)--;
+      h = h * 31 + hash_mix(packed_elements(key)[k].i);
+    }
+  }
+  return hash_mix(h);
+}
+
+uint64_t hash_key(typed_pointer table, typed_pointer key) {
+  uint64_t budget = HASH_BUDGET;
+  return table_field(table, TABLE_EQUAL) ? hash_equal(key, &budget) :
+    hash_mix(key.i);
+}
+
+bool same_key(typed_pointer table, typed_pointer a, typed_pointer b) {
+  return eq(a, b) || (table_field(table, TABLE_EQUAL) && equal(a, b));
+}
+
+/* Whether a collection can change the bits of key. */
+bool is_movable(typed_pointer key) {
+  return is_(PAIR, key) || (is_(OBJECT, key) && !is_large(key));
+}
+
+typed_pointer make_entries(uint64_t nslots) {
+  typed_pointer entries = make_object(VECTOR_OBJECT, 2 * nslots);
+  for(uint64_t k = 0; k < nslots; k++) {
+    object_set(entries, 2 * k, empty_slot);
+  }
+  return entries;
+}
+
+/* The slot of key in entries, or of the first free one its probe met
+   when found is false. */
+uint64_t probe(typed_pointer table, typed_pointer entries, typed_pointer key,
+               uint64_t h, bool *found) {
+  uint64_t mask = object_size(entries) / 2 - 1, free_slot = UINT64_MAX;
+  for(uint64_t i = h & mask; ; i = (i + 1) & mask) {
+    typed_pointer k = object_ref(entries, 2 * i);
+    if(eq(k, empty_slot)) {
+      *found = false;
+      return free_slot != UINT64_MAX ? free_slot : i;
+    } else if(eq(k, deleted_slot)) {
+      free_slot = free_slot != UINT64_MAX ? free_slot : i;
+    } else if(same_key(table, k, key)) {
+      *found = true;
+      return i;
+    }
+  }
+}
+
+/* Stores key and value into a free slot of entries, which must be there. */
+void insert_entry(typed_pointer table, typed_pointer key, typed_pointer value) {
+  typed_pointer entries = object_ref(table, TABLE_ENTRIES);
+  bool found;
+  uint64_t i = probe(table, entries, key, hash_key(table, key), &found);
+  if(eq(object_ref(entries, 2 * i), empty_slot)) {
+    set_table_field(table, TABLE_USED, table_field(table, TABLE_USED) + 1);
+  }
+  object_set(entries, 2 * i, key);
+  object_set(entries, 2 * i + 1, value);
+}
+
+/* Moves up to n slots of the old entries into the current ones. */
+void move_entries(typed_pointer table, uint64_t n) {
+  typed_pointer old = object_ref(table, TABLE_OLD);
+  if(eq(old, empty_list)) {
+    return;
+  }
+  uint64_t i = table_field(table, TABLE_MOVED), nslots = object_size(old) / 2;
+  for(; n > 0 && i < nslots; n--, i++) {
+    typed_pointer key = object_ref(old, 2 * i);
+    if(!eq(key, empty_slot) && !eq(key, deleted_slot)) {
+      insert_entry(table, key, object_ref(old, 2 * i + 1));
+      object_set(old, 2 * i, deleted_slot);
+    }
+  }
+  set_table_field(table, TABLE_MOVED, i);
+  if(i == nslots) {
+    object_set(table, TABLE_OLD, empty_list);
+  }
+}
+
+/* Replaces the entries of the table in handle t by nslots fresh ones,
+   moving every key at once if rehash and leaving them in the old
+   entries otherwise. */
+void replace_entries(handle t, uint64_t nslots, bool rehash) {
+  if(rehash) {
+    move_entries(handle_ref(t), UINT64_MAX);
+  }
+  typed_pointer entries = make_entries(nslots);
+  typed_pointer table = handle_ref(t);
+  object_set(table, TABLE_OLD, object_ref(table, TABLE_ENTRIES));
+  object_set(table, TABLE_ENTRIES, entries);
+  set_table_field(table, TABLE_MOVED, 0);
+  set_table_field(table, TABLE_USED, 0);
+  if(rehash) {
+    move_entries(table, UINT64_MAX);
+  }
+}
+
+/* Readies the table in handle t for an operation: rehashes its keys if
+   a collection may have moved them, and moves a few old slots. */
+void touch_table(handle t) {
+  typed_pointer table = handle_ref(t);
+  uint64_t young = table_field(table, TABLE_YOUNG);
+  if(table_field(table, TABLE_MOVABLE) > 0 &&
+     (table_field(table, TABLE_EPOCH) != (heap->collections & VALUE_MASK.i) ||
+      (young > 0 && young != ((heap->minor_collections + 1) & VALUE_MASK.i)))) {
+    replace_entries(t, object_size(object_ref(table, TABLE_ENTRIES)) / 2,
+                    true);
+    table = handle_ref(t);
+    set_table_field(table, TABLE_EPOCH, heap->collections);
+    set_table_field(table, TABLE_YOUNG, 0);
+  }
+  move_entries(table, TABLE_MOVE_STEP);
+}
+
+/* Finds key in the table, returning its entries and slot. */
+bool find_entry(typed_pointer table, typed_pointer key,
+                typed_pointer *entries, uint64_t *i) {
+  uint64_t h = hash_key(table, key);
+  bool found;
+  *entries = object_ref(table, TABLE_ENTRIES);
+  *i = probe(table, *entries, key, h, &found);
+  if(!found && !eq(object_ref(table, TABLE_OLD), empty_list)) {
+    *entries = object_ref(table, TABLE_OLD);
+    *i = probe(table, *entries, key, h, &found);
+  }
+  return found;
+}
+
+/* (make-hash-table [eq?|equal?]) */
+typed_pointer prim_make_hash_table(handle args, uint64_t n) {
+  if(n > 1 || (n == 1 && !eq(handle_ref(args), primitive_eq) &&
+               !eq(handle_ref(args), primitive_equal))) {
+    return wrong_type;
+  }
+  uint64_t scope = enter_scope();
+  typed_pointer table = make_object(HASH_TABLE_OBJECT, TABLE_FIELDS);
+  handle t = make_handle(table);
+  typed_pointer entries = make_entries(TABLE_MIN_SLOTS);
+  table = handle_ref(t);
+  object_set(table, TABLE_ENTRIES, entries);
+  set_table_field(table, TABLE_MOVED, 0);
+  set_table_field(table, TABLE_COUNT, 0);
+  set_table_field(table, TABLE_USED, 0);
+  set_table_field(table, TABLE_EQUAL,
+                  n == 1 && eq(handle_ref(args), primitive_equal));
+  set_table_field(table, TABLE_EPOCH, heap->collections);
+  set_table_field(table, TABLE_YOUNG, 0);
+  set_table_field(table, TABLE_MOVABLE, 0);
+  leave_scope(scope);
+  return table;
+}
+
+/* (hash-ref table key [default]) returns default, or #f, when key is
+   not in table. */
+typed_pointer prim_hash_ref(handle args, uint64_t n) {
+  if(!is_object(handle_ref(args), HASH_TABLE_OBJECT)) {
+    return wrong_type;
+  }
+  touch_table(args);
+  typed_pointer entries;
+  uint64_t i;
+  if(find_entry(handle_ref(args), handle_ref(args + 1), &entries, &i)) {
+    return object_ref(entries, 2 * i + 1);
+  }
+  return n > 2 ? handle_ref(args + 2) : false_symbol;
+}
+
+typed_pointer prim_hash_set(handle args, uint64_t n) {
+  typed_pointer key = handle_ref(args + 1);
+  if(!is_object(handle_ref(args), HASH_TABLE_OBJECT) ||
+     eq(key, empty_slot) || eq(key, deleted_slot)) {
+    return wrong_type;
+  }
+  touch_table(args);
+  typed_pointer table = handle_ref(args), entries;
+  uint64_t i;
+  key = handle_ref(args + 1);
+  if(find_entry(table, key, &entries, &i)) {
+    if(eq(entries, object_ref(table, TABLE_ENTRIES))) {
+      object_set(entries, 2 * i + 1, handle_ref(args + 2));
+      return handle_ref(args + 2);
+    }
+    object_set(entries, 2 * i, deleted_slot);
+  } else {
+    set_table_field(table, TABLE_COUNT, table_field(table, TABLE_COUNT) + 1);
+    if(!table_field(table, TABLE_EQUAL) && is_movable(key)) {
+      set_table_field(table, TABLE_MOVABLE,
+                      table_field(table, TABLE_MOVABLE) + 1);
+    }
+  }
+  uint64_t nslots = object_size(object_ref(table, TABLE_ENTRIES)) / 2;
+  if(4 * (table_field(table, TABLE_USED) + 1) > 3 * nslots) {
+    move_entries(table, UINT64_MAX);
+    uint64_t count = table_field(table, TABLE_COUNT);
+    replace_entries(args, 2 * count > nslots ? 2 * nslots : nslots, false);
+  }
+  table = handle_ref(args);
+  if(!table_field(table, TABLE_EQUAL) && is_young(handle_ref(args + 1))) {
+    set_table_field(table, TABLE_YOUNG, heap->minor_collections + 1);
+  }
+  insert_entry(table, handle_ref(args + 1), handle_ref(args + 2));
+  return handle_ref(args + 2);
+}
+
+/* (hash-remove! table key) returns whether key was there. */
+typed_pointer prim_hash_remove(handle args, uint64_t n) {
+  if(!is_object(handle_ref(args), HASH_TABLE_OBJECT)) {
+    return wrong_type;
+  }
+  touch_table(args);
+  typed_pointer table = handle_ref(args), key = handle_ref(args + 1), entries;
+  uint64_t i;
+  if(!find_entry(table, key, &entries, &i)) {
+    return false_symbol;
+  }
+  object_set(entries, 2 * i, deleted_slot);
+  object_set(entries, 2 * i + 1, empty_list);
+  set_table_field(table, TABLE_COUNT, table_field(table, TABLE_COUNT) - 1);
+  if(!table_field(table, TABLE_EQUAL) && is_movable(key)) {
+    set_table_field(table, TABLE_MOVABLE,
+                    table_field(table, TABLE_MOVABLE) - 1);
+  }
+  return true_symbol;
+}
+
+typed_pointer prim_hash_count(handle args, uint64_t n) {
+  if(!is_object(handle_ref(args), HASH_TABLE_OBJECT)) {
+    return wrong_type;
+  }
+  return make_(FIXNUM, table_field(handle_ref(args), TABLE_COUNT));
+}
+
+/* The list primitives return #WRONG-TYPE# when given something other
+   than the list they walk. Those building a list push its elements and
+   make it with list_from_stack, and those taking a procedure call it
+   with call, keeping the lists they walk in their argument slots. */
+typed_pointer prim_car(handle args, uint64_t n) {
+  typed_pointer p = handle_ref(args);
+  return is_(PAIR, p) ? car(p) : wrong_type;
+}
+
+typed_pointer prim_cdr(handle args, uint64_t n) {
+  typed_pointer p = handle_ref(args);
+  return is_(PAIR, p) ? cdr(p) : wrong_type;
+}
+
+typed_pointer prim_null(handle args, uint64_t n) {
+  return eq(handle_ref(args), empty_list) ? true_symbol : false_symbol;
+}
+
+typed_pointer prim_pair(handle args, uint64_t n) {
+  return is_(PAIR, handle_ref(args)) ? true_symbol : false_symbol;
+}
+
+typed_pointer prim_list(handle args, uint64_t n) {
+  for(uint64_t k = 0; k < n; k++) {
+    push_root(handle_ref(args + k));
+  }
+  push_root(empty_list);
+  return list_from_stack(n);
+}
+
+typed_pointer prim_length(handle args, uint64_t n) {
+  typed_pointer list = handle_ref(args);
+  uint64_t length = 0;
+  for(; is_(PAIR, list); list = cdr(list)) {
+    length++;
+  }
+  return eq(list, empty_list) ? make_(FIXNUM, length) : wrong_type;
+}
+
+typed_pointer prim_reverse(handle args, uint64_t n) {
+  uint64_t length = 0;
+  for(typed_pointer list = handle_ref(args); is_(PAIR, list);
+      list = cdr(list)) {
+    push_root(car(list));
+    length++;
+  }
+  typed_pointer *values = &heap->gc_roots[heap->rused - length];
+  for(uint64_t k = 0; k < length / 2; k++) {
+    typed_pointer value = values[k];
+    values[k] = values[length - 1 - k];
+    values[length - 1 - k] = value;
+  }
+  push_root(empty_list);
+  return list_from_stack(length);
+}
+
+/* (append list ... tail) copies every list but the last. */
+typed_pointer prim_append(handle args, uint64_t n) {
+  if(n == 0) {
+    return empty_list;
+  }
+  uint64_t length = 0;
+  for(uint64_t k = 0; k + 1 < n; k++) {
+    for(typed_pointer list = handle_ref(args + k); is_(PAIR, list);
+        list = cdr(list)) {
+      push_root(car(list));
+      length++;
+    }
+  }
+  push_root(handle_ref(args + n - 1));
+  return list_from_stack(length);
+}
+
+typed_pointer prim_list_ref(handle args, uint64_t n) {
+  typed_pointer list = handle_ref(args), index = handle_ref(args + 1);
+  if(!is_(FIXNUM, index) || fixnum_value(index) < 0) {
+    return wrong_type;
+  }
+  for(int64_t k = fixnum_value(index); k > 0 && is_(PAIR, list); k--) {
+    list = cdr(list);
+  }
+  return is_(PAIR, list) ? car(list) : wrong_type;
+}
+
+typed_pointer prim_assq(handle args, uint64_t n) {
+  typed_pointer key = handle_ref(args);
+  for(typed_pointer list = handle_ref(args + 1); is_(PAIR, list);
+      list = cdr(list)) {
+    if(is_(PAIR, car(list)) && eq(car(car(list)), key)) {
+      return car(list);
+    }
+  }
+  return false_symbol;
+}
+
+typed_pointer prim_memq(handle args, uint64_t n) {
+  typed_pointer e = handle_ref(args);
+  for(typed_pointer list = handle_ref(args + 1); is_(PAIR, list);
+      list = cdr(list)) {
+    if(eq(car(list), e)) {
+      return list;
+    }
+  }
+  return false_symbol;
+}
+
+/* Calls the procedure in args on the cars of the lists after it,
+   advancing them, and returns whether they all had one. */
+bool call_on_cars(handle args, uint64_t n, typed_pointer *val) {
+  for(uint64_t k = 1; k < n; k++) {
+    if(!is_(PAIR, handle_ref(args + k))) {
+      return false;
+    }
+  }
+  push_root(handle_ref(args));
+  for(uint64_t k = 1; k < n; k++) {
+    push_root(car(handle_ref(args + k)));
+    handle_set(args + k, cdr(handle_ref(args + k)));
+  }
+  *val = call(n - 1);
+  return true;
+}
+
+/* (map f list ...) stops at the end of the shortest list. */
+typed_pointer prim_map(handle args, uint64_t n) {
+  uint64_t length = 0;
+  typed_pointer val;
+  while(call_on_cars(args, n, &val)) {
+    push_root(val);
+    length++;
+  }
+  push_root(empty_list);
+  return list_from_stack(length);
+}
+
+typed_pointer prim_for_each(handle args, uint64_t n) {
+  typed_pointer val;
+  while(call_on_cars(args, n, &val)) {
+  }
+  return empty_list;
+}
+
+typed_pointer prim_filter(handle args, uint64_t n) {
+  uint64_t length = 0;
+  typed_pointer val;
+  while(is_(PAIR, handle_ref(args + 1))) {
+    push_root(car(handle_ref(args + 1)));
+    if(!call_on_cars(args, 2, &val) || eq(val, false_symbol)) {
+      pop_root();
+    } else {
+      length++;
+    }
+  }
+  push_root(empty_list);
+  return list_from_stack(length);
+}
+
+/* (fold f init list) is (f xn ... (f x2 (f x1 init))). */
+typed_pointer prim_fold(handle args, uint64_t n) {
+  while(is_(PAIR, handle_ref(args + 2))) {
+    push_root(handle_ref(args));
+    push_root(car(handle_ref(args + 2)));
+    push_root(handle_ref(args + 1));
+    handle_set(args + 2, cdr(handle_ref(args + 2)));
+    typed_pointer acc = call(2);
+    handle_set(args + 1, acc);
+  }
+  return handle_ref(args + 1);
+}
+
+/* What tree_eval does with the value of the expression it evaluated,
+   saved on the root stack as the expression or operands left, the
+   environment, and a FIXNUM holding the kind and, for TREE_OPERAND, how
+   many values of the application are already on the stack below. */
+enum {
+  TREE_SET,
+  TREE_IF,
+  TREE_OPERAND,
+  TREE_BODY
+};
+
+void push_tree_continuation(int kind, typed_pointer exp, typed_pointer env,
+                            uint64_t count) {
+  push_root(exp);
+  push_root(env);
+  push_root(make_(FIXNUM, count * 4 + kind));
+}
+
+/* Sets val to the value of exp if it is a variable, a constant or a
+   quotation, which need no continuation. */
+bool tree_atom(typed_pointer exp, typed_pointer env, typed_pointer *val) {
+  if(is_(LOCAL, exp)) {
+    *val = local_value(exp, env);
+  } else if(is_self_evaluating(exp)) {
+    *val = exp;
+  } else if(is_variable(exp)) {
+    *val = lookup_variable_value(exp);
+  } else if(is_(PAIR, exp) && is_quoted(exp)) {
+    *val = text_of_quotation(exp);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/* A lambda outside of any other is analyzed in place the first time it
+   is evaluated, a define of the form (define (f . params) . body) being
+   turned into (define f (lambda params . body)) first, so evaluating
+   the same code again finds it analyzed.
+
+   Subexpressions are not evaluated by recursing: tree_eval saves a
+   continuation on the root stack and starts over on the subexpression,
+   and hands each value to the continuation on top, until none of its
+   own is left; predicates and operands that are atoms are evaluated on
+   the spot instead. The operator and operands of an application are
+   evaluated onto the root stack under their continuation, and a frame is
+   bound straight from there. Tail positions, the branches of an if and
+   the last expression of a body, save nothing, so a loop written as tail
+   calls runs in constant space and deep recursion only grows the root
+   stack. Compiled closures and primitives are left to call. */
+typed_pointer tree_eval(typed_pointer exp, typed_pointer env) {
+  uint64_t scope = enter_scope();
+  handle hexp = make_handle(exp), henv = make_handle(env);
+  typed_pointer val;
+  for(;;) {
+    exp = handle_ref(hexp);
+    env = handle_ref(henv);
+    if(tree_atom(exp, env, &val)) {
+    } else if (is_assignment(exp)) {
+      push_tree_continuation(TREE_SET, exp, env, 0);
+      handle_set(hexp, assignment_val(exp));
+      continue;
+    } else if (is_definition(exp)) {
+      if(is_(PAIR, car(cdr(exp)))) {
+        typed_pointer rest = cons(def_val(exp), empty_list);
+        typed_pointer var = def_var(handle_ref(hexp));
+        set_cdr(cdr(handle_ref(hexp)), rest);
+        set_car(cdr(handle_ref(hexp)), var);
+        exp = handle_ref(hexp);
+      }
+      push_tree_continuation(TREE_SET, exp, env, 0);
+      handle_set(hexp, def_val(exp));
+      continue;
+    } else if (is_if(exp)) {
+      if(tree_atom(if_predicate(exp), env, &val)) {
+        handle_set(hexp, eq(val, false_symbol) ? if_alternative(exp) :
+                   if_consequent(exp));
+        continue;
+      }
+      push_tree_continuation(TREE_IF, exp, env, 0);
+      handle_set(hexp, if_predicate(exp));
+      continue;
+    } else if (is_lexical_lambda(exp)) {
+      val = make_procedure(exp, env);
+    } else if (is_lambda(exp)) {
+      push_root(lexical_lambda(exp, empty_list));
+      set_cdr(handle_ref(hexp), cdr(peek_root()));
+      set_car(handle_ref(hexp), lexical_lambda_symbol);
+      pop_root();
+      val = make_procedure(handle_ref(hexp), handle_ref(henv));
+    } else {
+      assert(is_application(exp));
+      push_tree_continuation(TREE_OPERAND, operands(exp), env, 0);
+      handle_set(hexp, operator(exp));
+      continue;
+    }
+
+    /* Nothing allocates between popping a continuation and saving what
+       is still needed of it. */
+    bool resumed = false;
+    while(!resumed && heap->rused > scope + 2) {
+      typed_pointer *top = &heap->gc_roots[heap->rused];
+      exp = top[-3];
+      env = top[-2];
+      uint64_t kind = fixnum_value(top[-1]) % 4;
+      uint64_t count = fixnum_value(top[-1]) / 4;
+      heap->rused -= 3;
+      if(kind == TREE_SET) {
+        typed_pointer var = car(cdr(exp));
+        if(is_(LOCAL, var)) {
+          set_local(var, val, env);
+        } else if(is_assignment(exp)) {
+          val = set_var_val(var, val);
+        } else {
+          val = define_var(var, val);
+        }
+      } else if(kind == TREE_IF) {
+        handle_set(hexp, eq(val, false_symbol) ? if_alternative(exp) :
+                   if_consequent(exp));
+        handle_set(henv, env);
+        resumed = true;
+      } else if(kind == TREE_OPERAND) {
+        push_root(val);
+        count++;
+        while(has_operands(exp) && tree_atom(first_operand(exp), env, &val)) {
+          push_root(val);
+          count++;
+          exp = rest_operands(exp);
+        }
+        if(has_operands(exp)) {
+          push_tree_continuation(TREE_OPERAND, rest_operands(exp), env,
+                                 count);
+          handle_set(hexp, first_operand(exp));
+          handle_set(henv, env);
+          resumed = true;
+        } else if(!is_procedure(heap->gc_roots[heap->rused - count]) ||
+                  is_compiled_closure(heap->gc_roots[heap->rused - count])) {
+          val = call(count - 1);
+        } else {
+          env = closure_frame(count - 1, &exp);
+          kind = TREE_BODY;
+        }
+      }
+      if(kind == TREE_BODY) {
+        if(!eq(cdr(exp), empty_list)) {
+          push_tree_continuation(TREE_BODY, cdr(exp), env, 0);
+        }
+        handle_set(hexp, car(exp));
+        handle_set(henv, env);
+        resumed = true;
+      }
+    }
+    if(!resumed) {
+      break;
+    }
+  }
+  leave_scope(scope);
+  return val;
+}
+
+/* BYTECODE */
+
+/* eval compiles each expression it is given, after the lexical pass, to
+   a CODE_OBJECT and runs it on a stack machine whose operand stack is
+   the root stack, so that everything it holds survives collections.
+   Every compiled lambda gets its own CODE_OBJECT, which its closures
+   keep as their body. Element 0 of a CODE_OBJECT belongs to the JIT;
+   the instructions follow it. An instruction is an opcode followed by
+   its operands, all stored as elements: FIXNUM counts and jump targets,
+   LOCAL and SYMBOL variables, and constants of any type. OP_CALL also
+   carries the operator when it is a global variable, as a hint for the
+   JIT; a call in tail position, the last expression of a body or a
+   branch of an if in one, is an OP_TAIL_CALL instead.
+
+   A lambda with no lambda inside it cannot have its frame captured, so
+   its frame need not be allocated: its closures are marked STACK_FRAME
+   and their arguments stay on the root stack where the caller put
+   them, followed by the rest of the frame. Its body reads and writes
+   them with OP_STACK_LOCAL and OP_SET_STACK_LOCAL, by index from the
+   frame pointer, and its other locals are one level shallower, since
+   its environment is the closure's.
+
+   Setting use_vm to false falls back to tree_eval, for differential
+   testing. */
+enum {
+  OP_CONST,
+  OP_LOCAL,
+  OP_STACK_LOCAL,
+  OP_GLOBAL,
+  OP_SET_LOCAL,
+  OP_SET_STACK_LOCAL,
+  OP_SET_GLOBAL,
+  OP_DEFINE_GLOBAL,
+  OP_JUMP,
+  OP_JUMP_IF_FALSE,
+  OP_CLOSURE,
+  OP_CALL,
+  OP_TAIL_CALL,
+  OP_POP,
+  OP_RETURN
+};
+
+bool use_vm = true;
+
+/* Code being compiled: a CODE_OBJECT held by a handle and grown by
+   doubling, of which used elements are filled, for a body whose frame
+   may be on the stack. */
+typedef struct code_buffer_t {
+  handle words;
+  uint64_t used;
+  bool stack_frame;
+} code_buffer_t;
+
+code_buffer_t make_code_buffer(bool stack_frame) {
+  typed_pointer words = make_object(CODE_OBJECT, 16);
+  object_set(words, 0, make_(FIXNUM, 0));
+  return (code_buffer_t){make_handle(words), 1, stack_frame};
+}
+
+void emit(code_buffer_t *b, typed_pointer word) {
+  uint64_t size = object_size(handle_ref(b->words));
+  if(b->used == size) {
+    push_root(word);
+    typed_pointer words = make_object(CODE_OBJECT, 2 * size);
+    for(uint64_t k = 0; k < size; k++) {
+      object_set(words, k, object_ref(handle_ref(b->words), k));
+    }
+    handle_set(b->words, words);
+    word = pop_root();
+  }
+  object_set(handle_ref(b->words), b->used++, word);
+}
+
+void emit_op(code_buffer_t *b, uint64_t op) {
+  emit(b, make_(FIXNUM, op));
+}
+
+/* Emits a jump with no target yet, returning where the target goes. */
+uint64_t emit_jump(code_buffer_t *b, uint64_t op) {
+  emit_op(b, op);
+  emit(b, make_(FIXNUM, 0));
+  return b->used - 1;
+}
+
+void patch_jump(code_buffer_t *b, uint64_t at) {
+  object_set(handle_ref(b->words), at, make_(FIXNUM, b->used));
+}
+
+/* Emits op for local, or its stack frame counterpart. */
+void emit_local(code_buffer_t *b, uint64_t op, typed_pointer local) {
+  if(!b->stack_frame) {
+    emit_op(b, op);
+    emit(b, local);
+  } else if(local_depth(local) == 0) {
+    emit_op(b, op == OP_LOCAL ? OP_STACK_LOCAL : OP_SET_STACK_LOCAL);
+    emit(b, make_(FIXNUM, local_index(local)));
+  } else {
+    emit_op(b, op);
+    emit(b, make_local(local_depth(local) - 1, local_index(local)));
+  }
+}
+
+/* Whether any of exps, which have been through the lexical pass,
+   makes a closure. */
+bool has_lambda(typed_pointer exps) {
+  for(; is_(PAIR, exps); exps = cdr(exps)) {
+    typed_pointer exp = car(exps);
+    if(is_(PAIR, exp) && !is_quoted(exp) &&
+       (is_lexical_lambda(exp) || has_lambda(exp))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* The filled part of the buffer as a CODE_OBJECT of its own. */
+typed_pointer finish_code(code_buffer_t *b) {
+  typed_pointer code = make_object(CODE_OBJECT, b->used);
+  for(uint64_t k = 0; k < b->used; k++) {
+    object_set(code, k, object_ref(handle_ref(b->words), k));
+  }
+  return code;
+}
+
+void compile_exp(code_buffer_t *b, typed_pointer exp, bool tail);
+
+/* Leaves only the value of the last of exps, which is in tail position
+   if the sequence is. */
+void compile_sequence(code_buffer_t *b, typed_pointer exps, bool tail) {
+  uint64_t scope = enter_scope();
+  handle hexps = make_handle(exps);
+  while(!eq(cdr(handle_ref(hexps)), empty_list)) {
+    compile_exp(b, car(handle_ref(hexps)), false);
+    emit_op(b, OP_POP);
+    handle_set(hexps, cdr(handle_ref(hexps)));
+  }
+  compile_exp(b, car(handle_ref(hexps)), tail);
+  leave_scope(scope);
+}
+
+typed_pointer compile_body(typed_pointer exps, bool stack_frame) {
+  uint64_t scope = enter_scope();
+  handle hexps = make_handle(exps);
+  code_buffer_t b = make_code_buffer(stack_frame);
+  compile_sequence(&b, handle_ref(hexps), true);
+  emit_op(&b, OP_RETURN);
+  typed_pointer code = finish_code(&b);
+  leave_scope(scope);
+  return code;
+}
+
+/* exp has been through the lexical pass, so its lambdas are analyzed
+   and its defines are all of the form (define var val). */
+void compile_exp(code_buffer_t *b, typed_pointer exp, bool tail) {
+  uint64_t scope = enter_scope();
+  handle hexp = make_handle(exp);
+  if(is_(LOCAL, exp)) {
+    emit_local(b, OP_LOCAL, exp);
+  } else if(is_variable(exp)) {
+    emit_op(b, OP_GLOBAL);
+    emit(b, handle_ref(hexp));
+  } else if(!is_(PAIR, exp)) {
+    emit_op(b, OP_CONST);
+    emit(b, handle_ref(hexp));
+  } else if(is_quoted(exp)) {
+    emit_op(b, OP_CONST);
+    emit(b, text_of_quotation(handle_ref(hexp)));
+  } else if(is_assignment(exp) || is_definition(exp)) {
+    compile_exp(b, car(cdr(cdr(exp))), false);
+    typed_pointer var = car(cdr(handle_ref(hexp)));
+    if(is_(LOCAL, var)) {
+      emit_local(b, OP_SET_LOCAL, var);
+    } else {
+      emit_op(b, is_assignment(handle_ref(hexp)) ? OP_SET_GLOBAL :
+              OP_DEFINE_GLOBAL);
+      emit(b, car(cdr(handle_ref(hexp))));
+    }
+  } else if(is_if(exp)) {
+    compile_exp(b, if_predicate(exp), false);
+    uint64_t alternative = emit_jump(b, OP_JUMP_IF_FALSE);
+    compile_exp(b, if_consequent(handle_ref(hexp)), tail);
+    uint64_t end = emit_jump(b, OP_JUMP);
+    patch_jump(b, alternative);
+    compile_exp(b, if_alternative(handle_ref(hexp)), tail);
+    patch_jump(b, end);
+  } else if(is_lexical_lambda(exp)) {
+    bool stack_frame = !has_lambda(cdr(cdr(cdr(exp))));
+    uint64_t size = car(cdr(cdr(exp))).i & VALUE_MASK.i;
+    emit_op(b, OP_CLOSURE);
+    emit(b, car(cdr(handle_ref(hexp))));
+    emit(b, make_(FIXNUM, size | (stack_frame ? STACK_FRAME : 0)));
+    emit(b, compile_body(cdr(cdr(cdr(handle_ref(hexp)))), stack_frame));
+  } else {
+    assert(is_application(exp));
+    typed_pointer hint = is_variable(car(exp)) ? car(exp) : empty_list;
+    uint64_t n = 0;
+    for(; is_(PAIR, exp); n++) {
+      compile_exp(b, car(exp), false);
+      handle_set(hexp, cdr(handle_ref(hexp)));
+      exp = handle_ref(hexp);
+    }
+    emit_op(b, tail ? OP_TAIL_CALL : OP_CALL);
+    emit(b, make_(FIXNUM, n - 1));
+    emit(b, hint);
+  }
+  leave_scope(scope);
+}
+
+/* Compiles a top-level expression to code that returns its value. */
+typed_pointer compile(typed_pointer exp) {
+  exp = lexical_pass(exp, empty_list);
+  return compile_body(cons(exp, empty_list), false);
+}
+
+/* Saves where run is to resume once the call of the n arguments on top
+   of the stack returns, below the operator. */
+void push_continuation(uint64_t n, uint64_t pc, uint64_t fp, handle code,
+                       handle env) {
+  push_root(make_(FIXNUM, pc));
+  push_root(make_(FIXNUM, fp));
+  push_root(handle_ref(code));
+  push_root(handle_ref(env));
+  typed_pointer *top = &heap->gc_roots[heap->rused];
+  typed_pointer continuation[4] = {top[-4], top[-3], top[-2], top[-1]};
+  memmove(top - n - 1, top - n - 5, sizeof(typed_pointer) * (n + 1));
+  memcpy(top - n - 5, continuation, sizeof(continuation));
+}
+
+/* Binds the n arguments on top of the stack in place for the closure
+   below them, which needs a stack frame. */
+void bind_stack_frame(typed_pointer op_val, uint64_t n) {
+  uint64_t arity = procedure_arity(op_val);
+  uint64_t size = procedure_frame_size(op_val);
+  uint64_t fp = heap->rused - n - 1;
+  for(uint64_t k = arity; k < n && k < size; k++) {
+    heap->gc_roots[fp + 1 + k] = var_not_found;
+  }
+  heap->rused = fp + 1 + (n < size ? n : size);
+  while(heap->rused < fp + 1 + size) {
+    push_root(var_not_found);
+  }
+}
+
+typed_pointer execute(typed_pointer code, typed_pointer env, uint64_t n);
+
+/* Calls the procedure below the n arguments on top of the stack,
+   popping all of them. Closures are bound straight from the stack. */
+typed_pointer call(uint64_t n) {
+  typed_pointer op_val = heap->gc_roots[heap->rused - n - 1];
+  if(is_compiled_closure(op_val)) {
+    typed_pointer val = execute(empty_list, empty_list, n);
+    heap->rused -= n + 1;
+    return val;
+  } else if(is_procedure(op_val)) {
+    typed_pointer body;
+    typed_pointer frame = closure_frame(n, &body);
+    return eval_sequence(body, frame);
+  }
+  return call_primitive(n);
+}
+
+/* JIT */
+
+/* On Linux x86-64, code run jit_threshold times is translated to
+   native code, a template per instruction: most become a call to the
+   jit_ helper doing what the VM does, with the current code and
+   environment reached through the jit_frame_t in rbx, while jumps
+   become native jumps. A call of two arguments whose operator is a
+   global bound to add, sub, mult or eq? when the code is translated
+   gets that primitive inlined, guarded by checks that the operator is
+   still that primitive and, but for eq?, that both arguments are
+   fixnums; a failed guard takes the ordinary call. Immediates are
+   embedded in the native code and heap constants are read from the
+   code object, which may move. A call of a compiled closure returns to
+   execute with tail set to its number of arguments plus one, leaving
+   the call on the stack for execute to make, so native code never
+   recurses on the C stack. A call that is not a tail call also sets
+   resume to where the native code goes on: execute saves it in the
+   continuation, with JIT_RESUME set, and once the callee returns runs
+   the native code again with resume set, which its prologue clears and
+   jumps to.
+
+   Element 0 of a CODE_OBJECT counts the runs so far, or holds
+   JIT_COMPILED and the index of its entry in jit_entries. The native
+   code goes in mmap'd regions that are only writable while code is
+   being copied in, and never freed. With perf_map set every function
+   is listed in /tmp/perf-<pid>.map so that perf can name it. A
+   threshold of 0 turns the JIT off. */
+typedef struct jit_frame_t {
+  handle code;
+  handle env;
+  uint64_t fp;
+  uint64_t tail;
+  uint64_t resume;
+} jit_frame_t;
+
+typedef void (*jit_fn)(jit_frame_t *frame);
+
+#define JIT_THRESHOLD 64
+#define JIT_COMPILED ((uint64_t)1 << 40)
+#define JIT_FAILED ((uint64_t)1 << 41)
+#define JIT_RESUME ((uint64_t)1 << 47)
+#define JIT_REGION_SIZE ((uint64_t)1 << 20)
+
+uint64_t jit_threshold = JIT_THRESHOLD;
+bool perf_map = false;
+
+jit_fn *jit_entries = NULL;
+uint64_t jit_nentries = 0;
+uint64_t jit_sentries = 0;
+
+/* Marks code as translated to fn. */
+void jit_register(typed_pointer code, jit_fn fn) {
+  if(jit_nentries == jit_sentries) {
+    jit_sentries = jit_sentries == 0 ? 64 : 2 * jit_sentries;
+    jit_entries = (jit_fn*)realloc(jit_entries, sizeof(jit_fn) * jit_sentries);
+  }
+  object_set(code, 0, make_(FIXNUM, JIT_COMPILED | jit_nentries));
+  jit_entries[jit_nentries++] = fn;
+}
+
+void jit_push(jit_frame_t *frame, uint64_t e) {
+  push_root((typed_pointer){.i = e});
+}
+
+void jit_const(jit_frame_t *frame, uint64_t k) {
+  push_root(object_ref(handle_ref(frame->code), k));
+}
+
+void jit_local(jit_frame_t *frame, uint64_t local) {
+  push_root(local_value((typed_pointer){.i = local}, handle_ref(frame->env)));
+}
+
+void jit_stack_local(jit_frame_t *frame, uint64_t k) {
+  push_root(heap->gc_roots[frame->fp + 1 + k]);
+}
+
+void jit_global(jit_frame_t *frame, uint64_t var) {
+  push_root(lookup_variable_value((typed_pointer){.i = var}));
+}
+
+void jit_set_local(jit_frame_t *frame, uint64_t local) {
+  set_local((typed_pointer){.i = local}, peek_root(), handle_ref(frame->env));
+}
+
+void jit_set_stack_local(jit_frame_t *frame, uint64_t k) {
+  heap->gc_roots[frame->fp + 1 + k] = peek_root();
+}
+
+void jit_set_global(jit_frame_t *frame, uint64_t var) {
+  typed_pointer val = set_var_val((typed_pointer){.i = var}, peek_root());
+  heap->gc_roots[heap->rused - 1] = val;
+}
+
+void jit_define_global(jit_frame_t *frame, uint64_t var) {
+  define_var((typed_pointer){.i = var}, peek_root());
+}
+
+bool jit_pop_false(jit_frame_t *frame, uint64_t unused) {
+  return eq(pop_root(), false_symbol);
+}
+
+void jit_closure(jit_frame_t *frame, uint64_t k) {
+  typed_pointer code = handle_ref(frame->code);
+  typed_pointer body = object_ref(code, k + 2);
+  push_root(make_closure(object_ref(code, k), object_ref(code, k + 1), body,
+                         handle_ref(frame->env)));
+}
+
+/* Leaves a call of a compiled closure to execute and makes any other
+   call right away. */
+void jit_call(jit_frame_t *frame, uint64_t n) {
+  if(is_compiled_closure(heap->gc_roots[heap->rused - n - 1])) {
+    frame->tail = n + 1;
+  } else {
+    push_root(call(n));
+  }
+}
+
+void jit_pop(jit_frame_t *frame, uint64_t unused) {
+  pop_root();
+}
+
+bool is_inlined_primitive(typed_pointer p) {
+  return eq(p, primitive_add) || eq(p, primitive_sub) ||
+    eq(p, primitive_mult) || eq(p, primitive_eq);
+}
+
+/* Whether e can be embedded in native code: anything but a pointer
+   into the heap. */
+bool is_immediate(typed_pointer e) {
+  return !is_(PAIR, e) && !is_(OBJECT, e) && !is_(LINK, e) && !is_(MOVED, e);
+}
+
+#if defined(__x86_64__) && defined(__linux__)
+
+uint8_t *jit_region = NULL;
+uint64_t jit_rsize = 0;
+uint64_t jit_rused = 0;
+FILE *jit_perf_map = NULL;
+
+typedef struct jit_buffer_t {
+  uint8_t *bytes;
+  uint64_t size;
+  uint64_t used;
+} jit_buffer_t;
+
+void jit_bytes(jit_buffer_t *b, const char *bytes, uint64_t n) {
+  while(b->used + n > b->size) {
+    b->size *= 2;
+    b->bytes = (uint8_t*)realloc(b->bytes, b->size);
+  }
+  memcpy(b->bytes + b->used, bytes, n);
+  b->used += n;
+}
+
+void jit_u32(jit_buffer_t *b, uint32_t x) {
+  jit_bytes(b, (const char*)&x, 4);
+}
+
+void jit_u64(jit_buffer_t *b, uint64_t x) {
+  jit_bytes(b, (const char*)&x, 8);
+}
+
+/* Emits the given jump or jcc opcode with a 32-bit displacement to be
+   filled in by jit_patch, returning where the displacement goes. */
+uint64_t jit_jump(jit_buffer_t *b, const char *op, uint64_t n) {
+  jit_bytes(b, op, n);
+  jit_u32(b, 0);
+  return b->used - 4;
+}
+
+void jit_patch(jit_buffer_t *b, uint64_t at, uint64_t target) {
+  int32_t rel = (int32_t)(target - (at + 4));
+  memcpy(b->bytes + at, &rel, 4);
+}
+
+/* Returns to execute if the call just made left a compiled closure to
+   it, with resume set to the code following, where the native code goes
+   on once the closure returns. */
+void jit_resume_point(jit_buffer_t *b) {
+  jit_bytes(b, "\x48\x83\xbb", 3);                 /* cmp qword tail, 0 */
+  jit_u32(b, offsetof(jit_frame_t, tail));
+  jit_bytes(b, "\x00", 1);
+  uint64_t done = jit_jump(b, "\x0f\x84", 2);      /* je done */
+  jit_bytes(b, "\x48\x8d\x05", 3);                 /* lea rax, [rip+done] */
+  uint64_t lea = b->used;
+  jit_u32(b, 0);
+  jit_bytes(b, "\x48\x89\x83", 3);                 /* mov resume, rax */
+  jit_u32(b, offsetof(jit_frame_t, resume));
+  jit_bytes(b, "\x5b\xc3", 2);                     /* pop rbx; ret */
+  jit_patch(b, done, b->used);
+  jit_patch(b, lea, b->used);
+}
+
+/* helper(frame, arg) */
+void jit_helper(jit_buffer_t *b, void *helper, uint64_t arg) {
+  jit_bytes(b, "\x48\x89\xdf", 3);                 /* mov rdi, rbx */
+  jit_bytes(b, "\x48\xbe", 2);                     /* mov rsi, arg */
+  jit_u64(b, arg);
+  jit_bytes(b, "\x48\xb8", 2);                     /* mov rax, helper */
+  jit_u64(b, (uint64_t)helper);
+  jit_bytes(b, "\xff\xd0", 2);                     /* call rax */
+}
+
+/* The inlined call of primitive with the two arguments on top of the
+   stack, falling back to jit_call. */
+void jit_primitive(jit_buffer_t *b, typed_pointer primitive) {
+  uint64_t slow[4], nslow = 0;
+  jit_bytes(b, "\x48\xb8", 2);                     /* mov rax, &heap */
+  jit_u64(b, (uint64_t)&heap);
+  jit_bytes(b, "\x48\x8b\x00", 3);                 /* mov rax, [rax] */
+  jit_bytes(b, "\x48\x8b\x88", 3);                 /* mov rcx, roots */
+  jit_u32(b, offsetof(heap_t, gc_roots));
+  jit_bytes(b, "\x48\x8b\x90", 3);                 /* mov rdx, rused */
+  jit_u32(b, offsetof(heap_t, rused));
+  jit_bytes(b, "\x48\x8d\x4c\xd1\xe8", 5);         /* lea rcx, [rcx+rdx*8-24] */
+  jit_bytes(b, "\x48\xbe", 2);                     /* mov rsi, primitive */
+  jit_u64(b, primitive.i);
+  jit_bytes(b, "\x48\x39\x31", 3);                 /* cmp [rcx], rsi */
+  slow[nslow++] = jit_jump(b, "\x0f\x85", 2);      /* jne slow */
+  jit_bytes(b, "\x48\x8b\x71\x08", 4);             /* mov rsi, [rcx+8] */
+  jit_bytes(b, "\x48\x8b\x79\x10", 4);             /* mov rdi, [rcx+16] */
+  if(eq(primitive, primitive_eq)) {
+    jit_bytes(b, "\x48\x39\xfe", 3);               /* cmp rsi, rdi */
+    jit_bytes(b, "\x48\xbe", 2);                   /* mov rsi, #f */
+    jit_u64(b, false_symbol.i);
+    jit_bytes(b, "\x49\xb8", 2);                   /* mov r8, #t */
+    jit_u64(b, true_symbol.i);
+    jit_bytes(b, "\x49\x0f\x44\xf0", 4);           /* cmove rsi, r8 */
+  } else {
+    jit_bytes(b, "\x49\x89\xf0", 3);               /* mov r8, rsi */
+    jit_bytes(b, "\x49\xc1\xe8\x30", 4);           /* shr r8, 48 */
+    jit_bytes(b, "\x41\x81\xf8", 3);               /* cmp r8d, FIXNUM */
+    jit_u32(b, FIXNUM.i >> 48);
+    slow[nslow++] = jit_jump(b, "\x0f\x85", 2);    /* jne slow */
+    jit_bytes(b, "\x49\x89\xf8", 3);               /* mov r8, rdi */
+    jit_bytes(b, "\x49\xc1\xe8\x30", 4);           /* shr r8, 48 */
+    jit_bytes(b, "\x41\x81\xf8", 3);               /* cmp r8d, FIXNUM */
+    jit_u32(b, FIXNUM.i >> 48);
+    slow[nslow++] = jit_jump(b, "\x0f\x85", 2);    /* jne slow */
+    /* Shifted up by 16 the 48-bit values overflow exactly when their
+       result leaves the fixnum range, which takes the slow path. */
+    jit_bytes(b, "\x48\xc1\xe6\x10", 4);           /* shl rsi, 16 */
+    jit_bytes(b, "\x48\xc1\xe7\x10", 4);           /* shl rdi, 16 */
+    if(eq(primitive, primitive_add)) {
+      jit_bytes(b, "\x48\x01\xfe", 3);             /* add rsi, rdi */
+    } else if(eq(primitive, primitive_sub)) {
+      jit_bytes(b, "\x48\x29\xfe", 3);             /* sub rsi, rdi */
+    } else {
+      jit_bytes(b, "\x48\xc1\xff\x10", 4);         /* sar rdi, 16 */
+      jit_bytes(b, "\x48\x0f\xaf\xf7", 4);         /* imul rsi, rdi */
+    }
+    slow[nslow++] = jit_jump(b, "\x0f\x80", 2);    /* jo slow */
+    jit_bytes(b, "\x48\xc1\xee\x10", 4);           /* shr rsi, 16 */
+    jit_bytes(b, "\x49\xb8", 2);                   /* mov r8, FIXNUM */
+    jit_u64(b, FIXNUM.i);
+    jit_bytes(b, "\x4c\x09\xc6", 3);               /* or rsi, r8 */
+  }
+  jit_bytes(b, "\x48\x89\x31", 3);                 /* mov [rcx], rsi */
+  jit_bytes(b, "\x48\x83\xea\x02", 4);             /* sub rdx, 2 */
+  jit_bytes(b, "\x48\x89\x90", 3);                 /* mov rused, rdx */
+  jit_u32(b, offsetof(heap_t, rused));
+  uint64_t done = jit_jump(b, "\xe9", 1);          /* jmp done */
+  for(uint64_t k = 0; k < nslow; k++) {
+    jit_patch(b, slow[k], b->used);
+  }
+  jit_helper(b, (void*)jit_call, 2);
+  jit_patch(b, done, b->used);
+}
+
+/* Copies the n bytes of native code into executable memory. */
+jit_fn jit_place(uint8_t *bytes, uint64_t n) {
+  if(jit_region == NULL || jit_rused + n > jit_rsize) {
+    uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t size = n > JIT_REGION_SIZE ? (n + page - 1) / page * page :
+      JIT_REGION_SIZE;
+    void *region = mmap(NULL, size, PROT_READ | PROT_EXEC,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(region == MAP_FAILED) {
+      return NULL;
+    }
+    jit_region = (uint8_t*)region;
+    jit_rsize = size;
+    jit_rused = 0;
+  }
+  if(mprotect(jit_region, jit_rsize, PROT_READ | PROT_WRITE) != 0) {
+    return NULL;
+  }
+  uint8_t *start = jit_region + jit_rused;
+  memcpy(start, bytes, n);
+  jit_rused += (n + 15) & ~(uint64_t)15;
+  mprotect(jit_region, jit_rsize, PROT_READ | PROT_EXEC);
+  return (jit_fn)start;
+}
+
+/* Translates code, returning NULL if it cannot be placed. */
+jit_fn jit_compile(typed_pointer code) {
+  uint64_t size = object_size(code);
+  uint64_t *offsets = (uint64_t*)malloc(sizeof(uint64_t) * size);
+  uint64_t *fixups = (uint64_t*)malloc(sizeof(uint64_t) * size);
+  uint64_t *targets = (uint64_t*)malloc(sizeof(uint64_t) * size);
+  uint64_t nfixups = 0;
+  jit_buffer_t b = {(uint8_t*)malloc(256), 256, 0};
+  jit_bytes(&b, "\x53", 1);                        /* push rbx */
+  jit_bytes(&b, "\x48\x89\xfb", 3);                /* mov rbx, rdi */
+  jit_bytes(&b, "\x48\x8b\x83", 3);                /* mov rax, resume */
+  jit_u32(&b, offsetof(jit_frame_t, resume));
+  jit_bytes(&b, "\x48\x85\xc0", 3);                /* test rax, rax */
+  uint64_t start = jit_jump(&b, "\x0f\x84", 2);    /* je start */
+  jit_bytes(&b, "\x48\xc7\x83", 3);                /* mov resume, 0 */
+  jit_u32(&b, offsetof(jit_frame_t, resume));
+  jit_u32(&b, 0);
+  jit_bytes(&b, "\xff\xe0", 2);                    /* jmp rax */
+  jit_patch(&b, start, b.used);
+  for(uint64_t pc = 1; pc < size;) {
+    offsets[pc] = b.used;
+    uint64_t op = object_ref(code, pc).i & VALUE_MASK.i;
+    typed_pointer arg = pc + 1 < size ? object_ref(code, pc + 1) : empty_list;
+    switch(op) {
+    case OP_CONST:
+      if(is_immediate(arg)) {
+        jit_helper(&b, (void*)jit_push, arg.i);
+      } else {
+        jit_helper(&b, (void*)jit_const, pc + 1);
+      }
+      pc += 2;
+      break;
+    case OP_LOCAL:
+      jit_helper(&b, (void*)jit_local, arg.i);
+      pc += 2;
+      break;
+    case OP_STACK_LOCAL:
+      jit_helper(&b, (void*)jit_stack_local, arg.i & VALUE_MASK.i);
+      pc += 2;
+      break;
+    case OP_GLOBAL:
+      jit_helper(&b, (void*)jit_global, arg.i);
+      pc += 2;
+      break;
+    case OP_SET_LOCAL:
+      jit_helper(&b, (void*)jit_set_local, arg.i);
+      pc += 2;
+      break;
+    case OP_SET_STACK_LOCAL:
+      jit_helper(&b, (void*)jit_set_stack_local, arg.i & VALUE_MASK.i);
+      pc += 2;
+      break;
+    case OP_SET_GLOBAL:
+      jit_helper(&b, (void*)jit_set_global, arg.i);
+      pc += 2;
+      break;
+    case OP_DEFINE_GLOBAL:
+      jit_helper(&b, (void*)jit_define_global, arg.i);
+      pc += 2;
+      break;
+    case OP_JUMP:
+      targets[nfixups] = arg.i & VALUE_MASK.i;
+      fixups[nfixups++] = jit_jump(&b, "\xe9", 1);
+      pc += 2;
+      break;
+    case OP_JUMP_IF_FALSE:
+      jit_helper(&b, (void*)jit_pop_false, 0);
+      jit_bytes(&b, "\x84\xc0", 2);                /* test al, al */
+      targets[nfixups] = arg.i & VALUE_MASK.i;
+      fixups[nfixups++] = jit_jump(&b, "\x0f\x85", 2);
+      pc += 2;
+      break;
+    case OP_CLOSURE:
+      jit_helper(&b, (void*)jit_closure, pc + 1);
+      pc += 4;
+      break;
+    case OP_CALL:
+    case OP_TAIL_CALL: {
+      typed_pointer hint = object_ref(code, pc + 2);
+      typed_pointer op_val = is_variable(hint) ?
+        lookup_variable_value(hint) : op_not_found;
+      if((arg.i & VALUE_MASK.i) == 2 && is_inlined_primitive(op_val)) {
+        jit_primitive(&b, op_val);
+      } else {
+        jit_helper(&b, (void*)jit_call, arg.i & VALUE_MASK.i);
+      }
+      if(op == OP_TAIL_CALL) {
+        jit_bytes(&b, "\x5b\xc3", 2);              /* pop rbx; ret */
+      } else {
+        jit_resume_point(&b);
+      }
+      pc += 3;
+      break;
+    }
+    case OP_POP:
+      jit_helper(&b, (void*)jit_pop, 0);
+      pc++;
+      break;
+    case OP_RETURN:
+      jit_bytes(&b, "\x5b\xc3", 2);                /* pop rbx; ret */
+      pc++;
+      break;
+    }
+  }
+  for(uint64_t k = 0; k < nfixups; k++) {
+    jit_patch(&b, fixups[k], offsets[targets[k]]);
+  }
+  jit_fn fn = jit_place(b.bytes, b.used);
+  if(fn != NULL && perf_map) {
+    if(jit_perf_map == NULL) {
+      char name[64];
+      snprintf(name, sizeof(name), "/tmp/perf-%d.map", (int)getpid());
+      jit_perf_map = fopen(name, "w");
+    }
+    if(jit_perf_map != NULL) {
+      fprintf(jit_perf_map, "%lx %lx brevelisp_code_%lu\n",
+              (uint64_t)fn, b.used, jit_nentries);
+      fflush(jit_perf_map);
+    }
+  }
+  free(b.bytes);
+  free(offsets);
+  free(fixups);
+  free(targets);
+  return fn;
+}
+
+#endif
+
+/* Counts a run of code, returning its native code once there is some. */
+jit_fn jit_entry(typed_pointer code) {
+  uint64_t state = object_ref(code, 0).i & VALUE_MASK.i;
+  if(state & JIT_COMPILED) {
+    return jit_entries[state & ~JIT_COMPILED];
+  }
+#if defined(__x86_64__) && defined(__linux__)
+  if(jit_threshold == 0 || (state & JIT_FAILED) || ++state < jit_threshold) {
+    object_set(code, 0, make_(FIXNUM, state));
+    return NULL;
+  }
+  jit_fn fn = jit_compile(code);
+  if(fn == NULL) {
+    object_set(code, 0, make_(FIXNUM, JIT_FAILED));
+    return NULL;
+  }
+  jit_register(code, fn);
+  return fn;
+#else
+  return NULL;
+#endif
+}
+
+/* Dispatch is threaded: every instruction jumps straight to the next
+   one's label. words points into the code object, so it is reloaded
+   after anything that can allocate and so move it. A call of a compiled
+   closure does not recurse: OP_CALL saves the caller's pc, frame
+   pointer, code and environment on the root stack below the operator
+   and switches to the callee, and its OP_RETURN resumes the caller from
+   there. The frame pointer fp is where the operator was, so a stack
+   frame starts just above it, and returning drops everything from it
+   up. An OP_TAIL_CALL moves the operator and arguments down to fp and
+   switches without saving anything, so a loop written as tail calls
+   runs in constant space. Native code hands its calls of compiled
+   closures back here to be made the same way, its continuations
+   holding where in it to resume rather than a pc.
+
+   execute runs code in env or, given empty_list for code, calls the
+   compiled closure below the n arguments on top of the stack, leaving
+   them there. */
+typed_pointer execute(typed_pointer code, typed_pointer env, uint64_t n) {
+  static void *dispatch[] = {
+    &&op_const, &&op_local, &&op_stack_local, &&op_global, &&op_set_local,
+    &&op_set_stack_local, &&op_set_global, &&op_define_global, &&op_jump,
+    &&op_jump_if_false, &&op_closure, &&op_call, &&op_tail_call, &&op_pop,
+    &&op_return
+  };
+  uint64_t scope = enter_scope();
+  handle hcode = make_handle(code), henv = make_handle(env);
+  uint64_t base = heap->rused, fp = base, pc;
+  typed_pointer *words, val, body;
+  jit_fn entry;
+  jit_frame_t frame;
+
+#define NEXT goto *dispatch[words[pc++].i & VALUE_MASK.i]
+#define OPERAND (words[pc++])
+#define RELOAD words = object_slots(handle_ref(hcode)) + 1; \
+    env = handle_ref(henv)
+
+  if(eq(code, empty_list)) {
+    for(uint64_t k = 0; k <= n; k++) {
+      push_root(heap->gc_roots[scope - n - 1 + k]);
+    }
+    goto enter_closure;
+  }
+ enter:
+  entry = jit_entry(handle_ref(hcode));
+  if(entry != NULL) {
+    frame = (jit_frame_t){hcode, henv, fp, 0, 0};
+ native:
+    entry(&frame);
+    if(frame.tail > 0 && frame.resume > 0) {
+      n = frame.tail - 1;
+      push_continuation(n, JIT_RESUME | frame.resume, fp, hcode, henv);
+      goto enter_closure;
+    } else if(frame.tail > 0) {
+      n = frame.tail - 1;
+      goto tail_call;
+    }
+    val = pop_root();
+    goto leave;
+  }
+  pc = 1;
+  RELOAD;
+  NEXT;
+ op_const:
+  push_root(read_barrier(&words[pc++]));
+  NEXT;
+ op_local:
+  push_root(local_value(OPERAND, env));
+  NEXT;
+ op_stack_local:
+  push_root(heap->gc_roots[fp + 1 + (OPERAND.i & VALUE_MASK.i)]);
+  NEXT;
+ op_global:
+  push_root(lookup_variable_value(OPERAND));
+  NEXT;
+ op_set_local:
+  set_local(OPERAND, peek_root(), env);
+  NEXT;
+ op_set_stack_local:
+  heap->gc_roots[fp + 1 + (OPERAND.i & VALUE_MASK.i)] = peek_root();
+  NEXT;
+ op_set_global:
+  val = set_var_val(OPERAND, peek_root());
+  heap->gc_roots[heap->rused - 1] = val;
+  NEXT;
+ op_define_global:
+  define_var(OPERAND, peek_root());
+  NEXT;
+ op_jump:
+  pc = words[pc].i & VALUE_MASK.i;
+  NEXT;
+ op_jump_if_false:
+  if(eq(pop_root(), false_symbol)) {
+    pc = words[pc].i & VALUE_MASK.i;
+  } else {
+    pc++;
+  }
+  NEXT;
+ op_closure:
+  val = make_closure(words[pc], words[pc + 1], read_barrier(&words[pc + 2]),
+                     env);
+  pc += 3;
+  RELOAD;
+  push_root(val);
+  NEXT;
+ op_call:
+  n = OPERAND.i & VALUE_MASK.i;
+  pc++;
+  if(is_compiled_closure(heap->gc_roots[heap->rused - n - 1])) {
+    push_continuation(n, pc, fp, hcode, henv);
+    goto enter_closure;
+  }
+  val = call(n);
+  RELOAD;
+  push_root(val);
+  NEXT;
+ op_tail_call:
+  n = OPERAND.i & VALUE_MASK.i;
+  if(!is_compiled_closure(heap->gc_roots[heap->rused - n - 1])) {
+    val = call(n);
+    goto leave;
+  }
+ tail_call:
+  memmove(&heap->gc_roots[fp], &heap->gc_roots[heap->rused - n - 1],
+          sizeof(typed_pointer) * (n + 1));
+  heap->rused = fp + n + 1;
+ enter_closure:
+  fp = heap->rused - n - 1;
+  val = heap->gc_roots[fp];
+  if(has_stack_frame(val)) {
+    handle_set(hcode, procedure_body(val));
+    handle_set(henv, procedure_env(val));
+    bind_stack_frame(val, n);
+  } else {
+    env = closure_frame(n, &body);
+    handle_set(hcode, body);
+    handle_set(henv, env);
+  }
+  goto enter;
+ op_pop:
+  pop_root();
+  NEXT;
+ op_return:
+  val = pop_root();
+ leave:
+  heap->rused = fp;
+  if(fp > base) {
+    handle_set(henv, pop_root());
+    handle_set(hcode, pop_root());
+    fp = pop_root().i & VALUE_MASK.i;
+    pc = pop_root().i & VALUE_MASK.i;
+    push_root(val);
+    if(pc & JIT_RESUME) {
+      entry = jit_entry(handle_ref(hcode));
+      frame = (jit_frame_t){hcode, henv, fp, 0, pc & ~JIT_RESUME};
+      goto native;
+    }
+    RELOAD;
+    NEXT;
+  }
+  leave_scope(scope);
+  return val;
+
+#undef NEXT
+#undef OPERAND
+#undef RELOAD
+}
+
+typed_pointer run(typed_pointer code, typed_pointer env) {
+  return execute(code, env, 0);
+}
+
+typed_pointer eval(typed_pointer exp, typed_pointer env) {
+  if(!use_vm) {
+    return tree_eval(exp, env);
+  }
+  push_root(env);
+  typed_pointer code = compile(exp);
+  return run(code, pop_root());
+}
+
+void setup_env() {
+  empty_list = insert_symbol("()");
+  quote_symbol = insert_symbol("quote");
+  set_symbol = insert_symbol("set!");
+  define_symbol = insert_symbol("define");
+  if_symbol = insert_symbol("if");
+  lambda_symbol = insert_symbol("lambda");
+  true_symbol = insert_symbol("#t");
+  false_symbol = insert_symbol("#f");
+  var_not_found = insert_symbol("#VAR-NOT-FOUND#");
+  op_not_found = insert_symbol("#OP-NOT-FOUND#");
+  wrong_arity = insert_symbol("#WRONG-ARITY#");
+  wrong_type = insert_symbol("#WRONG-TYPE#");
+  io_error = insert_symbol("#IO-ERROR#");
+  empty_slot = insert_symbol("#EMPTY#");
+  deleted_slot = insert_symbol("#DELETED#");
+  procedure_symbol = insert_symbol("#PROCEDURE#");
+  record_symbol = insert_symbol("#RECORD#");
+  lexical_lambda_symbol = insert_symbol("#LAMBDA#");
+
+  primitive_eq = register_primitive("eq?", prim_eq, 2);
+  primitive_mult = register_primitive("mult", prim_mult, 2);
+  primitive_sub = register_primitive("sub", prim_sub, 2);
+  primitive_cons = register_primitive("cons", prim_cons, 2);
+  primitive_add = register_primitive("add", prim_add, 2);
+  primitive_make_vector = register_primitive("make-vector", prim_make_vector,
+                                             VARIADIC(1));
+  primitive_vector_ref = register_primitive("vector-ref", prim_vector_ref, 2);
+  primitive_vector_set = register_primitive("vector-set!", prim_vector_set, 3);
+  primitive_vector_length = register_primitive("vector-length",
+                                               prim_vector_length, 1);
+  primitive_gensym = register_primitive("gensym", prim_gensym, 0);
+  register_primitive("make-f64vector", prim_make_f64vector, VARIADIC(1));
+  register_primitive("make-i64vector", prim_make_i64vector, VARIADIC(1));
+  register_primitive("f64vector", prim_f64vector, VARIADIC(0));
+  register_primitive("i64vector", prim_i64vector, VARIADIC(0));
+  register_primitive("vector-add", prim_vector_add, 2);
+  register_primitive("vector-sub", prim_vector_sub, 2);
+  register_primitive("vector-mul", prim_vector_mul, 2);
+  register_primitive("vector-scale", prim_vector_scale, 2);
+  register_primitive("vector-sum", prim_vector_sum, 1);
+  register_primitive("vector-dot", prim_vector_dot, 2);
+  register_primitive("vector-min", prim_vector_min, 1);
+  register_primitive("vector-max", prim_vector_max, 1);
+  register_primitive("mmap-file", prim_mmap_file, 1);
+  register_primitive("bytevector-length", prim_bytevector_length, 1);
+  register_primitive("bytevector-u8-ref", prim_bytevector_u8_ref, 2);
+  register_primitive("bytevector-i32-ref", prim_bytevector_i32_ref, 2);
+  register_primitive("bytevector-i64-ref", prim_bytevector_i64_ref, 2);
+  register_primitive("bytevector-f64-ref", prim_bytevector_f64_ref, 2);
+  primitive_equal = register_primitive("equal?", prim_equal, 2);
+  register_primitive("make-hash-table", prim_make_hash_table, VARIADIC(0));
+  register_primitive("hash-ref", prim_hash_ref, VARIADIC(2));
+  register_primitive("hash-set!", prim_hash_set, 3);
+  register_primitive("hash-remove!", prim_hash_remove, 2);
+  register_primitive("hash-count", prim_hash_count, 1);
+  register_primitive("car", prim_car, 1);
+  register_primitive("cdr", prim_cdr, 1);
+  register_primitive("null?", prim_null, 1);
+  register_primitive("pair?", prim_pair, 1);
+  register_primitive("list", prim_list, VARIADIC(0));
+  register_primitive("length", prim_length, 1);
+  register_primitive("reverse", prim_reverse, 1);
+  register_primitive("append", prim_append, VARIADIC(0));
+  register_primitive("list-ref", prim_list_ref, 2);
+  register_primitive("assq", prim_assq, 2);
+  register_primitive("memq", prim_memq, 2);
+  register_primitive("map", prim_map, VARIADIC(2));
+  register_primitive("for-each", prim_for_each, VARIADIC(2));
+  register_primitive("filter", prim_filter, 2);
+  register_primitive("fold", prim_fold, 3);
+  push_root(empty_list);
+  symbols->pinned = symbols->used;
+}
+
+void print_result(typed_pointer res) {
+  char *rs = sexp_to_str(res);
+  printf("%s\n", rs);
+  free(rs);
+  printf("> ");
+}
+
+void repl(FILE *f) {
+  reader_t r = file_reader(f);
+  typed_pointer res;
+
+  printf("> ");
+  while(read_datum(&r, &res)) {
+    res = eval(res, peek_root());
+    print_result(res);
+  }
+  free_reader(&r);
+}
+
+/* AOT */
+
+/* aot translates a program to C that includes this file, so that it
+   runs on the same runtime without reading or compiling anything. Each
+   top-level form is compiled as eval would, and every CODE_OBJECT
+   becomes a C function doing what the JIT's native code does, calling
+   the same jit_ helpers; calls of add, sub, mult and eq? by name go
+   through inline_primitive first. At startup aot_load interns the
+   symbols the functions use, pinning them since only the C code refers
+   to them, reads the quoted constants and makes for each function a
+   CODE_OBJECT marked as translated to it, which closures take as their
+   body. aot_run then runs the top-level forms, printing what the REPL
+   would. The output builds into an executable, or with -DAOT_LIBRARY
+   into a shared object exporting start_runtime, aot_program and
+   stop_runtime. */
+typedef struct aot_t {
+  FILE *out;
+  char **names;
+  uint64_t nnames;
+  char **data;
+  int64_t *functions;
+  uint64_t nconstants;
+  uint64_t nfunctions;
+} aot_t;
+
+handle aot_constants;
+
+/* Replaces the operator below the two arguments on top of the stack
+   and them by its result if it is add, sub, mult or eq? and can take
+   them inline, as the JIT's native code does: arithmetic only on
+   fixnums and only when the result is one. */
+bool inline_primitive(void) {
+  typed_pointer *top = &heap->gc_roots[heap->rused - 3];
+  typed_pointer p = top[0];
+  if(!is_inlined_primitive(p)) {
+    return false;
+  }
+  if(eq(p, primitive_eq)) {
+    top[0] = eq(top[1], top[2]) ? true_symbol : false_symbol;
+  } else if(!is_(FIXNUM, top[1]) || !is_(FIXNUM, top[2])) {
+    return false;
+  } else {
+    int64_t x = fixnum_value(top[1]), y = fixnum_value(top[2]), r;
+    if(eq(p, primitive_add)) {
+      r = x + y;
+    } else if(eq(p, primitive_sub)) {
+      r = x - y;
+    } else if(__builtin_mul_overflow(x, y, &r)) {
+      return false;
+    }
+    if(r < FIXNUM_MIN || r > FIXNUM_MAX) {
+      return false;
+    }
+    top[0] = make_(FIXNUM, (uint64_t)r);
+  }
+  heap->rused -= 2;
+  return true;
+}
+
+void aot_constant(jit_frame_t *frame, uint64_t k) {
+  push_root(object_ref(handle_ref(aot_constants), k));
+}
+
+void aot_closure(jit_frame_t *frame, uint64_t arity, uint64_t size,
+                 uint64_t k) {
+  push_root(make_closure(make_(FIXNUM, arity), make_(FIXNUM, size),
+                         object_ref(handle_ref(aot_constants), k),
+                         handle_ref(frame->env)));
+}
+
+/* Interns names, returning the symbols, and fills aot_constants: data[k]
+   is the text of constant k, or NULL if it is the code of
+   functions[codes[k]]. */
+typed_pointer* aot_load(const char **names, uint64_t nnames,
+                        const char **data, const int64_t *codes,
+                        const jit_fn *functions, uint64_t nconstants) {
+  typed_pointer *syms = (typed_pointer*)malloc(sizeof(typed_pointer) *
+                                               (nnames + 1));
+  for(uint64_t k = 0; k < nnames; k++) {
+    syms[k] = insert_symbol((char*)names[k]);
+  }
+  symbols->pinned = symbols->used;
+  aot_constants = make_handle(make_object(VECTOR_OBJECT, nconstants));
+  for(uint64_t k = 0; k < nconstants; k++) {
+    typed_pointer constant;
+    if(data[k] != NULL) {
+      constant = read_sexp(data[k]);
+    } else {
+      constant = make_object(CODE_OBJECT, 1);
+      jit_register(constant, functions[codes[k]]);
+    }
+    object_set(handle_ref(aot_constants), k, constant);
+  }
+  return syms;
+}
+
+void aot_run(const uint64_t *tops, uint64_t ntops) {
+  printf("> ");
+  for(uint64_t k = 0; k < ntops; k++) {
+    typed_pointer code = object_ref(handle_ref(aot_constants), tops[k]);
+    print_result(run(code, empty_list));
+  }
+}
+
+uint64_t aot_symbol(aot_t *a, typed_pointer sym) {
+  char *name = symbol_name(symbols, sym.i & VALUE_MASK.i);
+  for(uint64_t k = 0; k < a->nnames; k++) {
+    if(strcmp(a->names[k], name) == 0) {
+      return k;
+    }
+  }
+  a->names = (char**)realloc(a->names, sizeof(char*) * (a->nnames + 1));
+  a->names[a->nnames] = strdup(name);
+  return a->nnames++;
+}
+
+uint64_t aot_add_constant(aot_t *a, char *data, int64_t function) {
+  a->data = (char**)realloc(a->data, sizeof(char*) * (a->nconstants + 1));
+  a->functions = (int64_t*)realloc(a->functions,
+                                   sizeof(int64_t) * (a->nconstants + 1));
+  a->data[a->nconstants] = data;
+  a->functions[a->nconstants] = function;
+  return a->nconstants++;
+}
+
+void aot_string(FILE *out, const char *s) {
+  fputc('"', out);
+  for(; *s != '\0'; s++) {
+    if(*s == '"' || *s == '\\') {
+      fputc('\\', out);
+    }
+    fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+/* Emits e as an argument of a jit_ helper. */
+void aot_word(aot_t *a, typed_pointer e) {
+  if(is_(SYMBOL, e)) {
+    fprintf(a->out, "syms[%lu].i", aot_symbol(a, e));
+  } else {
+    fprintf(a->out, "0x%lxULL", e.i);
+  }
+}
+
+bool is_inlined_name(typed_pointer hint) {
+  if(!is_variable(hint)) {
+    return false;
+  }
+  char *name = symbol_name(symbols, hint.i & VALUE_MASK.i);
+  return strcmp(name, "add") == 0 || strcmp(name, "sub") == 0 ||
+    strcmp(name, "mult") == 0 || strcmp(name, "eq?") == 0;
+}
+
+/* Emits code and the code it makes closures of as C functions,
+   returning the index of the constant holding code. */
+uint64_t aot_code(aot_t *a, typed_pointer code) {
+  uint64_t size = object_size(code);
+  uint64_t *constants = (uint64_t*)calloc(size, sizeof(uint64_t));
+  bool *targets = (bool*)calloc(size, sizeof(bool));
+  bool *resumes = (bool*)calloc(size + 1, sizeof(bool));
+  bool resumable = false;
+  for(uint64_t pc = 1; pc < size;) {
+    uint64_t op = object_ref(code, pc).i & VALUE_MASK.i;
+    typed_pointer arg = pc + 1 < size ? object_ref(code, pc + 1) : empty_list;
+    if(op == OP_CONST && !is_immediate(arg)) {
+      constants[pc] = aot_add_constant(a, sexp_to_str(arg), -1);
+    } else if(op == OP_CLOSURE) {
+      constants[pc] = aot_code(a, object_ref(code, pc + 3));
+    } else if(op == OP_JUMP || op == OP_JUMP_IF_FALSE) {
+      targets[arg.i & VALUE_MASK.i] = true;
+    } else if(op == OP_CALL) {
+      resumes[pc + 3] = resumable = true;
+    }
+    pc += op == OP_CLOSURE ? 4 : op == OP_CALL || op == OP_TAIL_CALL ? 3 :
+      op == OP_POP || op == OP_RETURN ? 1 : 2;
+  }
+  uint64_t f = a->nfunctions++;
+  FILE *out = a->out;
+  fprintf(out, "\nstatic void code_%lu(jit_frame_t *frame) {\n", f);
+  if(resumable) {
+    fprintf(out, "  switch(frame->resume) {\n");
+    for(uint64_t pc = 1; pc < size; pc++) {
+      if(resumes[pc]) {
+        fprintf(out, "  case %lu:\n    frame->resume = 0;\n"
+                "    goto resume_%lu;\n", pc, pc);
+      }
+    }
+    fprintf(out, "  }\n");
+  }
+  for(uint64_t pc = 1; pc < size;) {
+    uint64_t op = object_ref(code, pc).i & VALUE_MASK.i;
+    typed_pointer arg = pc + 1 < size ? object_ref(code, pc + 1) : empty_list;
+    if(resumes[pc]) {
+      fprintf(out, " resume_%lu:\n", pc);
+    }
+    if(targets[pc]) {
+      fprintf(out, " pc_%lu:\n", pc);
+    }
+    fprintf(out, "  ");
+    switch(op) {
+    case OP_CONST:
+      if(is_immediate(arg)) {
+        fprintf(out, "jit_push(frame, ");
+        aot_word(a, arg);
+        fprintf(out, ");\n");
+      } else {
+        fprintf(out, "aot_constant(frame, %lu);\n", constants[pc]);
+      }
+      pc += 2;
+      break;
+    case OP_LOCAL:
+    case OP_STACK_LOCAL:
+    case OP_GLOBAL:
+    case OP_SET_LOCAL:
+    case OP_SET_STACK_LOCAL:
+    case OP_SET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+      fprintf(out, "%s(frame, ",
+              op == OP_LOCAL ? "jit_local" :
+              op == OP_STACK_LOCAL ? "jit_stack_local" :
+              op == OP_GLOBAL ? "jit_global" :
+              op == OP_SET_LOCAL ? "jit_set_local" :
+              op == OP_SET_STACK_LOCAL ? "jit_set_stack_local" :
+              op == OP_SET_GLOBAL ? "jit_set_global" : "jit_define_global");
+      if(op == OP_STACK_LOCAL || op == OP_SET_STACK_LOCAL) {
+        fprintf(out, "%lu", arg.i & VALUE_MASK.i);
+      } else {
+        aot_word(a, arg);
+      }
+      fprintf(out, ");\n");
+      pc += 2;
+      break;
+    case OP_JUMP:
+      fprintf(out, "goto pc_%lu;\n", arg.i & VALUE_MASK.i);
+      pc += 2;
+      break;
+    case OP_JUMP_IF_FALSE:
+      fprintf(out, "if(jit_pop_false(frame, 0)) goto pc_%lu;\n",
+              arg.i & VALUE_MASK.i);
+      pc += 2;
+      break;
+    case OP_CLOSURE:
+      fprintf(out, "aot_closure(frame, %lu, %lu, %lu);\n",
+              arg.i & VALUE_MASK.i, object_ref(code, pc + 2).i & VALUE_MASK.i,
+              constants[pc]);
+      pc += 4;
+      break;
+    case OP_CALL:
+    case OP_TAIL_CALL: {
+      typed_pointer hint = object_ref(code, pc + 2);
+      if((arg.i & VALUE_MASK.i) == 2 && is_inlined_name(hint)) {
+        fprintf(out, "if(!inline_primitive()) ");
+      }
+      fprintf(out, "jit_call(frame, %lu);\n", arg.i & VALUE_MASK.i);
+      if(op == OP_TAIL_CALL) {
+        fprintf(out, "  return;\n");
+      } else {
+        fprintf(out, "  if(frame->tail > 0) {\n"
+                "    frame->resume = %lu;\n    return;\n  }\n", pc + 3);
+      }
+      pc += 3;
+      break;
+    }
+    case OP_POP:
+      fprintf(out, "jit_pop(frame, 0);\n");
+      pc++;
+      break;
+    case OP_RETURN:
+      fprintf(out, "return;\n");
+      pc++;
+      break;
+    }
+  }
+  fprintf(out, "}\n");
+  free(constants);
+  free(targets);
+  free(resumes);
+  return aot_add_constant(a, NULL, f);
+}
+
+/* Translates the program read from in to C written to out. */
+void aot(FILE *in, FILE *out) {
+  aot_t a = {out, NULL, 0, NULL, NULL, 0, 0};
+  uint64_t *tops = NULL, ntops = 0;
+  reader_t r = file_reader(in);
+  typed_pointer form;
+
+  fprintf(out, "#define main brevelisp_main\n#include \"lisp.c\"\n"
+          "#undef main\n\nstatic typed_pointer *syms;\n");
+  while(read_datum(&r, &form)) {
+    typed_pointer code = compile(form);
+    tops = (uint64_t*)realloc(tops, sizeof(uint64_t) * (ntops + 1));
+    tops[ntops++] = aot_code(&a, code);
+  }
+  free_reader(&r);
+
+  fprintf(out, "\nstatic const char *names[] = {\n");
+  for(uint64_t k = 0; k < a.nnames; k++) {
+    fprintf(out, "  ");
+    aot_string(out, a.names[k]);
+    fprintf(out, ",\n");
+    free(a.names[k]);
+  }
+  fprintf(out, "  NULL\n};\n\nstatic const char *data[] = {\n");
+  for(uint64_t k = 0; k < a.nconstants; k++) {
+    fprintf(out, "  ");
+    if(a.data[k] != NULL) {
+      aot_string(out, a.data[k]);
+    } else {
+      fprintf(out, "NULL");
+    }
+    fprintf(out, ",\n");
+    free(a.data[k]);
+  }
+  fprintf(out, "};\n\nstatic const int64_t codes[] = {\n");
+  for(uint64_t k = 0; k < a.nconstants; k++) {
+    fprintf(out, "  %ld,\n", a.functions[k]);
+  }
+  fprintf(out, "};\n\nstatic const jit_fn functions[] = {\n");
+  for(uint64_t f = 0; f < a.nfunctions; f++) {
+    fprintf(out, "  code_%lu,\n", f);
+  }
+  fprintf(out, "};\n\nstatic const uint64_t tops[] = {\n");
+  for(uint64_t k = 0; k < ntops; k++) {
+    fprintf(out, "  %lu,\n", tops[k]);
+  }
+  fprintf(out, "};\n\n"
+          "void aot_program(void) {\n"
+          "  syms = aot_load(names, %lu, data, codes, functions, %lu);\n"
+          "  aot_run(tops, %lu);\n"
+          "}\n\n"
+          "#ifndef AOT_LIBRARY\n"
+          "int main(int argc, char **argv) {\n"
+          "  bool gc_stats = start_runtime(argc, argv);\n"
+          "  aot_program();\n"
+          "  stop_runtime(gc_stats);\n"
+          "  return 0;\n"
+          "}\n"
+          "#endif\n", a.nnames, a.nconstants, ntops);
+  free(a.names);
+  free(a.data);
+  free(a.functions);
+  free(tops);
+}
+
+void print_gc_stats(FILE *f) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(f, "heap: %lu elements per %s, %lu nursery\n",
+          heap->esize, heap->compact ? "space" : "semispace", heap->nsize);
+  if(heap->mapped > 0) {
+    fprintf(f, "mapped: %lu kB reserved, %lu kB pages\n",
+            heap->mapped / 1024, heap->page_size / 1024);
+  }
+  fprintf(f, "peak rss: %ld kB\n", usage.ru_maxrss);
+  fprintf(f, "full collections: %lu, %.3f ms\n",
+          heap->collections, heap->gc_time * 1e3);
+  fprintf(f, "minor collections: %lu, %.3f ms\n",
+          heap->minor_collections, heap->minor_gc_time * 1e3);
+  fprintf(f, "large objects: %lu elements\n", heap->lelems);
+  fprintf(f, "symbols: %lu ids, %lu free, %lu arena bytes\n",
+          symbols->used, symbols->free_ids.used, symbols->aused);
+  fprintf(f, "max pause: %.3f ms\n", heap->max_pause * 1e3);
+  uint64_t total = 0, count = 0;
+  for(int i = 0; i < 32; i++) {
+    total += heap->pauses[i];
+  }
+  for(int i = 0; i < 32; i++) {
+    count += heap->pauses[i];
+    if(count * 100 >= total * 99) {
+      fprintf(f, "p99 pause: < %lu us\n", (uint64_t)1 << i);
+      break;
+    }
+  }
+}
+
+/* Sizes are given in heap elements, optionally suffixed with k, m or g. */
+uint64_t parse_size(const char *s, uint64_t dflt) {
+  if(s == NULL) {
+    return dflt;
+  }
+  char *end;
+  errno = 0;
+  uint64_t n = strtoull(s, &end, 0);
+  if(errno == ERANGE || end == s) {
+    fprintf(stderr, "invalid size: %s\n", s);
+    return dflt;
+  }
+  switch(tolower(*end)) {
+  case 'g': n *= 1024; /* fall through */
+  case 'm': n *= 1024; /* fall through */
+  case 'k': n *= 1024;
+  }
+  return n;
+}
+
+const char* option_value(int argc, char **argv, const char *name, const char *env) {
+  size_t len = strlen(name);
+  for(int i = 1; i < argc; i++) {
+    if(strncmp(argv[i], name, len) == 0 && argv[i][len] == '=') {
+      return argv[i] + len + 1;
+    } else if(strcmp(argv[i], name) == 0) {
+      return "";
+    }
+  }
+  return getenv(env);
+}
+
+/* Sets up the heap and the global environment from the options,
+   returning whether to print GC statistics at exit. */
+bool start_runtime(int argc, char** argv) {
+  setvbuf(stdout, NULL, _IONBF, 0);
+
+  uint64_t heap_size = parse_size(option_value(argc, argv, "--heap",
+                                               "BREVELISP_HEAP"), 512);
+  uint64_t heap_max = parse_size(option_value(argc, argv, "--heap-max",
+                                              "BREVELISP_HEAP_MAX"), 1 << 26);
+  uint64_t nursery = parse_size(option_value(argc, argv, "--nursery",
+                                             "BREVELISP_NURSERY"), 1 << 15);
+  uint64_t gc_slice = parse_size(option_value(argc, argv, "--gc-slice",
+                                              "BREVELISP_GC_SLICE"), 0);
+  uint64_t gc_threads = parse_size(option_value(argc, argv, "--gc-threads",
+                                                "BREVELISP_GC_THREADS"), 1);
+  bool gc_stats = option_value(argc, argv, "--gc-stats",
+                               "BREVELISP_GC_STATS") != NULL;
+  bool large_heap = option_value(argc, argv, "--large-heap",
+                                 "BREVELISP_LARGE_HEAP") != NULL;
+  const char *huge = option_value(argc, argv, "--huge-pages",
+                                  "BREVELISP_HUGE_PAGES");
+  int huge_pages = NO_HUGE_PAGES;
+  if(huge != NULL && strcmp(huge, "explicit") == 0) {
+    huge_pages = EXPLICIT_HUGE_PAGES;
+  } else if(huge != NULL && strcmp(huge, "transparent") == 0) {
+    huge_pages = TRANSPARENT_HUGE_PAGES;
+  } else if(huge != NULL) {
+    fprintf(stderr, "unknown huge pages %s, using none\n", huge);
+  }
+  const char *collector = option_value(argc, argv, "--gc", "BREVELISP_GC");
+  bool compact = collector != NULL && strcmp(collector, "compact") == 0;
+  if(collector != NULL && !compact && strcmp(collector, "copy") != 0) {
+    fprintf(stderr, "unknown collector %s, using copy\n", collector);
+  }
+  if(compact) {
+    gc_slice = 0;
+  }
+  if(gc_slice > 0) {
+    gc_slice = gc_slice < 4 ? 4 : gc_slice;
+    nursery = 0;
+  }
+  jit_threshold = parse_size(option_value(argc, argv, "--jit-threshold",
+                                          "BREVELISP_JIT_THRESHOLD"),
+                             JIT_THRESHOLD);
+  perf_map = option_value(argc, argv, "--perf-map",
+                          "BREVELISP_PERF_MAP") != NULL;
+  const char *simd_name = option_value(argc, argv, "--simd",
+                                       "BREVELISP_SIMD");
+  const char *simd_names[] = {"scalar", "sse2", "avx2"};
+#if defined(__x86_64__)
+  simd = __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2;
+#endif
+  if(simd_name != NULL && strcmp(simd_name, "scalar") == 0) {
+    simd = SIMD_SCALAR;
+  } else if(simd_name != NULL && strcmp(simd_name, "sse2") == 0 &&
+            simd > SIMD_SSE2) {
+    simd = SIMD_SSE2;
+  } else if(simd_name != NULL && strcmp(simd_name, simd_names[simd]) != 0) {
+    fprintf(stderr, "unsupported simd %s, using %s\n", simd_name,
+            simd_names[simd]);
+  }
+  const char *evaluator = option_value(argc, argv, "--eval", "BREVELISP_EVAL");
+  use_vm = evaluator == NULL || strcmp(evaluator, "tree") != 0;
+  if(use_vm && evaluator != NULL && strcmp(evaluator, "vm") != 0) {
+    fprintf(stderr, "unknown evaluator %s, using vm\n", evaluator);
+  }
+
+  symbols = make_symbol_table(64);
+  heap = make_heap(heap_size, heap_max, nursery & ~(uint64_t)1, compact, 64);
+  heap->slice = gc_slice;
+  heap->threads = gc_threads > 0 ? gc_threads : 1;
+  if(large_heap || huge_pages != NO_HUGE_PAGES) {
+    if(huge_pages == EXPLICIT_HUGE_PAGES && !map_heap(heap, huge_pages)) {
+      fprintf(stderr, "no explicit huge pages, using transparent ones\n");
+      huge_pages = TRANSPARENT_HUGE_PAGES;
+    }
+    if(heap->mapped == 0 && !map_heap(heap, huge_pages)) {
+      fprintf(stderr, "cannot map the heap: %s\n", strerror(errno));
+    }
+  }
+
+  setup_env();
+  return gc_stats;
+}
+
+void stop_runtime(bool gc_stats) {
+  if(gc_stats) {
+    print_gc_stats(stderr);
+  }
+  
+  free_symbol_table(symbols);
+  free_heap(heap);
+  free(primitives);
+}
+
+int main(int argc, char** argv) {
+  bool gc_stats = start_runtime(argc, argv);
+  if(option_value(argc, argv, "--aot", "BREVELISP_AOT") != NULL) {
+    aot(stdin, stdout);
+  } else {
+    repl(stdin);
+  }
+  stop_runtime(gc_stats);
   return 0;
 }
@@ -1,3 +1,11 @@
+typed_pointer prim_sum(handle args, uint64_t n) {
+  uint32_t sum = 0;
+  for(uint64_t k = 0; k < n; k++) {
+    sum += (uint32_t)handle_ref(args + k).i;
+  }
+  return make_(FIXNUM, sum);
+}
+
 void test() {
   typed_pointer res;
   char *s = "()";
@@ -37,6 +45,33 @@ void test() {
   assert(eq(car(res), res));
   assert(eq(cdr(res), res));
 
+  uint64_t nsymbols = symbols->used;
+  char name[16];
+  for(int i = 0; i < 5000; i++) {
+    snprintf(name, sizeof(name), "sym%d", i);
+    insert_symbol(name);
+  }
+  for(int i = 4999; i >= 0; i--) {
+    snprintf(name, sizeof(name), "sym%d", i);
+    res = insert_symbol(name);
+    assert(strcmp(symbol_name(symbols, res.i & VALUE_MASK.i), name) == 0);
+  }
+  assert(symbols->used <= nsymbols + 5000);
+
+  uint64_t id = insert_symbol("unreferenced").i & VALUE_MASK.i;
+  push_root(insert_symbol("referenced"));
+  push_root(gensym());
+  gc();
+  assert(symbols->flags[id] & SYMBOL_FREE);
+  nsymbols = symbols->used;
+  insert_symbol("recycled");
+  assert(symbols->used == nsymbols);
+  res = pop_root();
+  assert(!eq(res, insert_symbol(symbol_name(symbols, res.i & VALUE_MASK.i))));
+  res = pop_root();
+  assert(eq(res, insert_symbol("referenced")));
+  assert(eq(empty_list, insert_symbol("()")));
+
   s = "(define #t (quote #t))";
   res = read_sexp(s);
   res = eval(res, peek_root());
@@ -181,5 +216,655 @@ void test() {
   res = eval(res, peek_root());  
   r = sexp_to_str(res);
   printf("%s\n", r);
+  assert(is_procedure(res));
+  free(r);
+
+  s = "(vector-ref (make-vector 3 7) 1)";
+  res = read_sexp(s);
+  printf("%s -> ", sexp_to_str(res));
+  res = eval(res, peek_root());
+  r = sexp_to_str(res);
+  printf("%s\n", r);
+  assert(eq(res, make_(FIXNUM, 7)));
+  free(r);
+
+  uint64_t rused = heap->rused;
+  s = "(define count (lambda (n) (if (eq? n 0) 0 (add 1 (count (sub n 1))))))";
+  res = read_sexp(s);
+  eval(res, peek_root());
+  res = read_sexp("(count 2000)");
+  res = eval(res, peek_root());
+  assert(eq(res, make_(FIXNUM, 2000)));
+  assert(heap->rused == rused);
+
+  s = "(define adder (lambda (x) (define y 10) (lambda (z) (set! x 5) (add x (add y z)))))";
+  res = read_sexp(s);
+  eval(res, peek_root());
+  res = read_sexp("((adder 1) 2)");
+  res = eval(res, peek_root());
+  assert(eq(res, make_(FIXNUM, 17)));
+  res = car(cdr(cdr(read_sexp(s))));
+  res = cdr(cdr(cdr(lexical_pass(res, empty_list))));
+  assert(is_(LOCAL, def_var(car(res))));
+  assert(eq(make_local(1, 0), car(cdr(car(cdr(cdr(cdr(car(cdr(res))))))))));
+  assert(heap->rused == rused);
+
+  s = "(define (branch c) (if c (define z 1) (define z 2)) z)";
+  for(int vm = 0; vm < 2; vm++) {
+    use_vm = vm;
+    eval(read_sexp(s), peek_root());
+    res = eval(read_sexp("(branch (eq? 1 2))"), peek_root());
+    assert(eq(res, make_(FIXNUM, 2)));
+    assert(eq(eval(read_sexp("z"), peek_root()), var_not_found));
+  }
+  use_vm = false;
+  res = read_sexp("(define (twice x) (mult x 2))");
+  typed_pointer top = peek_root();
+  push_root(res);
+  eval(res, top);
+  res = pop_root();
+  assert(is_lexical_lambda(car(cdr(cdr(res)))));
+  use_vm = true;
+  assert(eq(eval(read_sexp("(twice 4)"), peek_root()), make_(FIXNUM, 8)));
+  assert(heap->rused == rused);
+
+  s = "(define counter 1)";
+  res = read_sexp(s);
+  eval(res, peek_root());
+  s = "(define bump (lambda () (set! counter (add counter 1))))";
+  res = read_sexp(s);
+  eval(res, peek_root());
+  res = read_sexp("(bump)");
+  eval(res, peek_root());
+  gc();
+  res = read_sexp("(bump)");
+  res = eval(res, peek_root());
+  assert(eq(res, make_(FIXNUM, 3)));
+  assert(eq(lookup_variable_value(insert_symbol("counter")), res));
+  res = read_sexp("(set! unbound 1)");
+  res = eval(res, peek_root());
+  assert(eq(res, var_not_found));
+
+  char *programs[] = {
+    "(define fib (lambda (n) (if (eq? n 0) 0 (if (eq? n 1) 1 (add (fib (sub n 1)) (fib (sub n 2)))))))",
+    "(fib 15)",
+    "(define (compose f g) (lambda (x) (f (g x))))",
+    "((compose (lambda (x) (mult x 2)) (lambda (x) (add x 1))) 5)",
+    "(quote (a (b c) d))",
+    "((lambda (v) (vector-set! v 1 (quote x)) (vector-ref v 1)) (make-vector 3 0))",
+    "((lambda (n) (define m (add n 1)) (set! n (mult m m)) n) 4)",
+    "((lambda (a b) (define c (add a 1)) (mult c 2)) 4 5 6)",
+    "((lambda (a b) b) 1)"
+  };
+  for(uint64_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+    use_vm = false;
+    res = read_sexp(programs[i]);
+    char *expected = sexp_to_str(eval(res, peek_root()));
+    use_vm = true;
+    res = read_sexp(programs[i]);
+    r = sexp_to_str(eval(res, peek_root()));
+    assert(strcmp(r, expected) == 0);
+    free(expected);
+    free(r);
+  }
+
+  register_primitive("sum", prim_sum, VARIADIC(0));
+  for(int vm = 0; vm < 2; vm++) {
+    use_vm = vm;
+    res = read_sexp("(sum)");
+    assert(eq(eval(res, peek_root()), make_(FIXNUM, 0)));
+    res = read_sexp("(sum 1 2 (sum 3 4) 5)");
+    assert(eq(eval(res, peek_root()), make_(FIXNUM, 15)));
+    res = read_sexp("(add 1)");
+    assert(eq(eval(res, peek_root()), wrong_arity));
+    res = read_sexp("(make-vector 2 (quote x))");
+    res = eval(res, peek_root());
+    assert(eq(object_ref(res, 1), insert_symbol("x")));
+    res = read_sexp("(make-vector -1)");
+    assert(eq(eval(res, peek_root()), wrong_type));
+    res = read_sexp("(make-vector (quote x) 0)");
+    assert(eq(eval(res, peek_root()), wrong_type));
+  }
+
+  const char *lists[][2] = {
+    {"(reverse (quote (1 2 3)))", "(3 2 1)"},
+    {"(append (quote (1 2)) (quote ()) (quote (3 . 4)))", "(1 2 3 . 4)"},
+    {"(assq (quote b) (quote ((a 1) (b 2))))", "(b 2)"},
+    {"(memq (quote c) (quote (a b c d)))", "(c d)"},
+    {"(map add (quote (1 2)) (quote (10 20 30)))", "(11 22)"},
+    {"(filter pair? (quote (1 (2) 3 (4))))", "((2) (4))"},
+    {"(fold cons (quote ()) (quote (1 2 3)))", "(3 2 1)"},
+    {"(list-ref (quote (a b)) 2)", "#WRONG-TYPE#"},
+    {"(list-ref (list 1 2) -1)", "#WRONG-TYPE#"},
+    {"(list-ref (list 1 2) (quote x))", "#WRONG-TYPE#"},
+    {"(length (map (lambda (x) (cons x x)) (reverse (make-list 5000))))",
+     "5000"},
+  };
+  s = "(define make-list (lambda (n) (if (eq? n 0) (quote ()) (cons n (make-list (sub n 1))))))";
+  res = read_sexp(s);
+  eval(res, peek_root());
+  for(int vm = 0; vm < 2; vm++) {
+    use_vm = vm;
+    for(uint64_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+      res = read_sexp(lists[i][0]);
+      r = sexp_to_str(eval(res, peek_root()));
+      assert(strcmp(r, lists[i][1]) == 0);
+      free(r);
+    }
+  }
+
+  res = read_sexp("(define xs (make-i64vector 2000 3))");
+  eval(res, peek_root());
+  res = read_sexp("(define ys (f64vector 1 -2 3.5 4 5 6))");
+  eval(res, peek_root());
+  packed_elements(eval(read_sexp("xs"), peek_root()))[7] = make_(PAIR, 1);
+  packed_elements(eval(read_sexp("ys"), peek_root()))[1] = make_(OBJECT, 3);
+  for(int i = 0; i < 4; i++) {
+    eval(read_sexp("(length (make-list 5000))"), peek_root());
+  }
+  res = eval(read_sexp("xs"), peek_root());
+  assert(eq(packed_elements(res)[7], make_(PAIR, 1)));
+  packed_elements(res)[7].i = 3;
+  res = eval(read_sexp("ys"), peek_root());
+  assert(eq(packed_elements(res)[1], make_(OBJECT, 3)));
+  packed_elements(res)[1].f = -2;
+  const char *packed[][2] = {
+    {"(vector-dot xs (vector-scale xs 2))", "36000"},
+    {"(vector-sum (vector-mul ys ys))", "94.250000"},
+    {"(vector-min (vector-sub ys (vector-scale ys 2)))", "-6.000000"},
+    {"(vector-max ys)", "6.000000"},
+    {"(vector-add (i64vector 1 2) (f64vector 1 2))", "#WRONG-TYPE#"},
+    {"(vector-mul (i64vector 1 2 3 4 -5) (i64vector 2 2 2 2 2))",
+     "#i64(2 4 6 8 -10)"},
+    {"(make-f64vector -3)", "#WRONG-TYPE#"},
+    {"(make-i64vector (quote x) 1)", "#WRONG-TYPE#"},
+  };
+  int widest = SIMD_SCALAR;
+#if defined(__x86_64__)
+  widest = __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2;
+#endif
+  for(simd = SIMD_SCALAR; simd <= widest; simd++) {
+    for(uint64_t i = 0; i < sizeof(packed) / sizeof(packed[0]); i++) {
+      res = read_sexp(packed[i][0]);
+      r = sexp_to_str(eval(res, peek_root()));
+      assert(strcmp(r, packed[i][1]) == 0);
+      free(r);
+    }
+  }
+  simd = SIMD_SCALAR;
+  eval(read_sexp("(set! xs 0)"), peek_root());
+
+  const char *tables[][2] = {
+    {"(define t (make-hash-table))", "#HASH-TABLE#0#"},
+    {"(define (fill t n) (if (eq? n 0) t ((lambda (x) (fill t (sub n 1))) (hash-set! t n (mult n n)))))", "#PROCEDURE#"},
+    {"(define (drop t n) (if (eq? n 0) t ((lambda (x) (drop t (sub n 2))) (hash-remove! t n))))", "#PROCEDURE#"},
+    {"(hash-count (drop (fill t 3000) 3000))", "1500"},
+    {"(hash-ref t 77)", "5929"},
+    {"(hash-ref t 78 (quote none))", "none"},
+    {"(define k (cons 1 2))", "(1 . 2)"},
+    {"(hash-set! t k (quote pair))", "pair"},
+    {"(define e (make-hash-table equal?))", "#HASH-TABLE#0#"},
+    {"(hash-set! e (quote (a #(b 1))) 1)", "1"},
+    {"(hash-set! e (f64vector 1 2) 2)", "2"},
+    {"(length (make-list 5000))", "5000"},
+    {"(hash-ref t k)", "pair"},
+    {"(hash-ref t (cons 1 2))", "#f"},
+    {"(hash-ref e (quote (a #(b 1))))", "1"},
+    {"(hash-ref e (f64vector 1 2))", "2"},
+    {"(hash-remove! e (quote (a #(b 1))))", "#t"},
+    {"(hash-count e)", "1"},
+  };
+  for(uint64_t i = 0; i < sizeof(tables) / sizeof(tables[0]); i++) {
+    r = sexp_to_str(eval(read_sexp(tables[i][0]), peek_root()));
+    assert(strcmp(r, tables[i][1]) == 0);
+    free(r);
+  }
+  gc();
+  res = eval(read_sexp("(hash-ref t k)"), peek_root());
+  assert(eq(res, insert_symbol("pair")));
+  if(heap->nsize > 0) {
+    eval(read_sexp("(define j 0)"), peek_root());
+    eval(read_sexp("(hash-set! t (set! j (cons 3 4)) 1)"), peek_root());
+    minor_gc();
+    res = eval(read_sexp("(hash-ref t j)"), peek_root());
+    assert(eq(res, make_(FIXNUM, 1)));
+    top = peek_root();
+    res = lookup_variable_value(insert_symbol("t"));
+    push_root(object_ref(res, TABLE_ENTRIES));
+    uint64_t full = heap->collections;
+    minor_gc();
+    res = eval(read_sexp("(hash-ref t k)"), top);
+    assert(eq(res, insert_symbol("pair")));
+    res = lookup_variable_value(insert_symbol("t"));
+    assert(heap->collections != full ||
+           eq(object_ref(res, TABLE_ENTRIES), peek_root()));
+    pop_root();
+  }
+  eval(read_sexp("(set! t 0)"), peek_root());
+
+  const char *bignums[][2] = {
+    {"(add 140737488355327 1)", "140737488355328"},
+    {"(sub -140737488355328 1)", "-140737488355329"},
+    {"(mult 16777216 -8388608)", "-140737488355328"},
+    {"(fact 30)", "265252859812191058636308480000000"},
+    {"(sub 0 123456789012345678901234567890)",
+     "-123456789012345678901234567890"},
+    {"(add 100000000000000000000 -99999999999999999999)", "1"},
+    {"(grow 1 100)", "515377520732011331036461129765621272702107522001"},
+    {"(equal? (grow 1 100) (grow 1 100))", "#t"},
+    {"(sub (mult (add (fact 600) 1) (sub (fact 600) 1)) "
+     "(mult (fact 600) (fact 600)))", "-1"},
+    {"(vector-ref (i64vector 9223372036854775807) 0)", "9223372036854775807"},
+    {"(i64vector -9223372036854775807 1)", "#i64(-9223372036854775807 1)"},
+    {"(f64vector (fact 30))", "#f64(265252859812191068217601719009280.000000)"},
+    {"(i64vector (fact 30))", "#WRONG-TYPE#"},
+    {"(add (fact 30) (quote x))", "#WRONG-TYPE#"},
+  };
+  s = "(define fact (lambda (n) (if (eq? n 0) 1 (mult n (fact (sub n 1))))))";
+  eval(read_sexp(s), peek_root());
+  s = "(define grow (lambda (x n) (if (eq? n 0) x (grow (mult x 3) (sub n 1)))))";
+  eval(read_sexp(s), peek_root());
+  for(int vm = 0; vm < 2; vm++) {
+    use_vm = vm;
+    for(uint64_t i = 0; i < sizeof(bignums) / sizeof(bignums[0]); i++) {
+      r = sexp_to_str(eval(read_sexp(bignums[i][0]), peek_root()));
+      assert(strcmp(r, bignums[i][1]) == 0);
+      free(r);
+    }
+  }
+  assert(is_(FIXNUM, eval(read_sexp("(sub (add 140737488355327 1) 1)"),
+                          peek_root())));
+  assert(is_bignum(read_sexp("140737488355328")));
+
+  FILE *input = tmpfile();
+  fputs("(", input);
+  for(int64_t i = 0; i < 100000; i++) {
+    fprintf(input, " %ld", (long)i);
+  }
+  fputs(")\n", input);
+  for(int64_t i = 0; i < 100000; i++) {
+    fputc('(', input);
+  }
+  for(int64_t i = 0; i < 100000; i++) {
+    fputc(')', input);
+  }
+  fputs(" 123456789012345678901234567890 2.5\nend", input);
+  rewind(input);
+  reader_t lists_reader = file_reader(input);
+  assert(read_datum(&lists_reader, &res));
+  push_root(res);
+  assert(read_datum(&lists_reader, &res));
+  for(int64_t i = 1; i < 100000; i++) {
+    assert(eq(cdr(res), empty_list));
+    res = car(res);
+  }
+  assert(eq(res, empty_list));
+  res = pop_root();
+  for(int64_t i = 0; i < 100000; i++) {
+    assert(eq(car(res), make_(FIXNUM, i)));
+    res = cdr(res);
+  }
+  assert(eq(res, empty_list));
+  assert(read_datum(&lists_reader, &res) && is_bignum(res));
+  assert(read_datum(&lists_reader, &res) && res.f == 2.5);
+  assert(read_datum(&lists_reader, &res) && eq(res, insert_symbol("end")));
+  assert(!read_datum(&lists_reader, &res));
+  free_reader(&lists_reader);
+  fclose(input);
+
+  s = "(define loop (lambda (n acc) (if (eq? n 0) acc (loop (sub n 1) (add acc 1)))))";
+  res = read_sexp(s);
+  eval(res, peek_root());
+  uint64_t rsize = heap->rsize;
+  for(int vm = 0; vm < 2; vm++) {
+    use_vm = vm;
+    res = read_sexp("(loop 1000000 0)");
+    res = eval(res, peek_root());
+    assert(eq(res, make_(FIXNUM, 1000000)));
+    assert(heap->rsize == rsize);
+  }
+  s = "(define depth (lambda (n) (if (eq? n 0) 0 (add 1 (depth (sub n 1))))))";
+  res = read_sexp(s);
+  eval(res, peek_root());
+  for(int jit = 0; jit < 2; jit++) {
+    jit_threshold = jit ? JIT_THRESHOLD : 0;
+    res = read_sexp("(depth 100000)");
+    res = eval(res, peek_root());
+    assert(eq(res, make_(FIXNUM, 100000)));
+  }
+#if defined(__x86_64__) && defined(__linux__)
+  res = procedure_body(lookup_variable_value(insert_symbol("depth")));
+  assert(object_ref(res, 0).i & JIT_COMPILED);
+#endif
+  res = compile(read_sexp("(loop 1000 0)"));
+  push_root(res);
+  uint64_t allocated = heap->eused + heap->nused;
+  res = run(res, empty_list);
+  assert(eq(res, make_(FIXNUM, 1000)));
+  assert(heap->eused + heap->nused == allocated);
+  pop_root();
+  assert(heap->rused == rused);
+  use_vm = false;
+  eval(read_sexp(s), peek_root());
+  res = eval(read_sexp("(depth 200000)"), peek_root());
+  assert(eq(res, make_(FIXNUM, 200000)));
+  assert(heap->rused == rused);
+  use_vm = true;
+
+  s = "(define add2 (lambda (a b) (add a b)))";
+  res = read_sexp(s);
+  eval(res, peek_root());
+  for(uint64_t i = 0; i < JIT_THRESHOLD; i++) {
+    res = read_sexp("(add2 40 2)");
+    res = eval(res, peek_root());
+    assert(eq(res, make_(FIXNUM, 42)));
+  }
+#if defined(__x86_64__) && defined(__linux__)
+  res = procedure_body(lookup_variable_value(insert_symbol("add2")));
+  assert(object_ref(res, 0).i & JIT_COMPILED);
+#endif
+  res = read_sexp("(add2 1.5 2)");
+  typed_pointer sum = primitive_apply(primitive_add, cdr(res));
+  res = read_sexp("(add2 1.5 2)");
+  assert(eq(eval(res, peek_root()), sum));
+  res = read_sexp("(define plus add)");
+  eval(res, peek_root());
+  res = read_sexp("(define add sub)");
+  eval(res, peek_root());
+  res = read_sexp("(add2 40 2)");
+  assert(eq(eval(res, peek_root()), make_(FIXNUM, 38)));
+  res = read_sexp("(define add plus)");
+  eval(res, peek_root());
+  assert(heap->rused == rused);
+
+  char *program =
+    "(define fact (lambda (n) (if (eq? n 0) 1 (mult n (fact (sub n 1))))))\n"
+    "(fact 10)\n"
+    "(define pair (quote (a \"b\\\\c\" (1 . 2))))\n"
+    "pair\n"
+    "((lambda (k) (define f (lambda (x) (add x k))) (set! k 2) (f 40)) 1)\n"
+    "(make-vector 2 pair)\n";
+  char dir[256], path[320], command[1024];
+  snprintf(dir, sizeof(dir), "%s", __FILE__);
+  *(strrchr(dir, '/') ? strrchr(dir, '/') : dir) = '\0';
+  snprintf(path, sizeof(path), "/tmp/brevelisp-aot-%d", (int)getpid());
+  FILE *in = tmpfile();
+  fputs(program, in);
+  rewind(in);
+  snprintf(command, sizeof(command), "%s.c", path);
+  FILE *out = fopen(command, "w");
+  aot(in, out);
+  fclose(out);
+  rewind(in);
+  char expected[1024] = "> ";
+  reader_t reader = file_reader(in);
+  while(read_datum(&reader, &res)) {
+    r = sexp_to_str(eval(res, peek_root()));
+    strcat(strcat(expected, r), "\n> ");
+    free(r);
+  }
+  free_reader(&reader);
+  fclose(in);
+  snprintf(command, sizeof(command), "cc -I%s -o %s %s.c -lm -lpthread",
+           dir[0] != '\0' ? dir : ".", path, path);
+  if(system("cc --version > /dev/null 2>&1") == 0) {
+    assert(system(command) == 0);
+    FILE *p = popen(path, "r");
+    char output[1024];
+    output[fread(output, 1, sizeof(output) - 1, p)] = '\0';
+    assert(pclose(p) == 0);
+    assert(strcmp(output, expected) == 0);
+    remove(path);
+  } else {
+    fprintf(stderr, "no C compiler, skipping the AOT test\n");
+  }
+  snprintf(command, sizeof(command), "%s.c", path);
+  remove(command);
+  assert(heap->rused == rused);
+
+  snprintf(path, sizeof(path), "/tmp/brevelisp-mmap-%d", (int)getpid());
+  out = fopen(path, "wb");
+  int32_t i32 = -7;
+  int64_t i64 = 1234567;
+  double f64 = 2.5;
+  fwrite(&i32, sizeof(i32), 1, out);
+  fwrite(&i64, sizeof(i64), 1, out);
+  fwrite(&f64, sizeof(f64), 1, out);
+  fclose(out);
+  snprintf(command, sizeof(command), "(define bv (mmap-file (quote %s)))",
+           path);
+  eval(read_sexp(command), peek_root());
+  remove(path);
+  res = eval(read_sexp("bv"), peek_root());
+  assert(is_object(res, BYTEVECTOR_OBJECT));
+  large_object_t *mapped = large_object(res);
+  const char *loads[][2] = {
+    {"(bytevector-length bv)", "20"},
+    {"(bytevector-i32-ref bv 0)", "-7"},
+    {"(bytevector-i64-ref bv 4)", "1234567"},
+    {"(bytevector-f64-ref bv 12.0)", "2.500000"},
+    {"(bytevector-f64-ref bv 13)", "#WRONG-TYPE#"},
+    {"(mmap-file (quote /nonexistent/brevelisp))", "#IO-ERROR#"},
+  };
+  for(uint64_t i = 0; i < sizeof(loads) / sizeof(loads[0]); i++) {
+    r = sexp_to_str(eval(read_sexp(loads[i][0]), peek_root()));
+    assert(strcmp(r, loads[i][1]) == 0);
+    free(r);
+  }
+  eval(read_sexp("(set! bv 0)"), peek_root());
+  gc();
+  if(heap->collecting) {
+    gc_step(heap->esize * 4);
+  }
+  assert(mapped->slots == NULL);
+
+  uint64_t collections = heap->collections + heap->minor_collections;
+  uint64_t esize = heap->esize;
+  int64_t n = heap->esize + heap->nsize;
+  res = empty_list;
+  for(int64_t i = 0; i < n; i++) {
+    res = cons(make_(FIXNUM, i), res);
+  }
+  assert(heap->collections + heap->minor_collections > collections);
+  assert(heap->esize > esize);
+  for(int64_t i = n - 1; i >= 0; i--) {
+    assert(eq(car(res), make_(FIXNUM, i)));
+    res = cdr(res);
+  }
+  assert(eq(res, empty_list));
+
+  if(heap->nsize > 0) {
+    res = make_pair();
+    set_car(res, empty_list);
+    set_cdr(res, empty_list);
+    push_root(res);
+    typed_pointer young = cons(make_(FIXNUM, 7), empty_list);
+    assert(is_young(young));
+    set_car(peek_root(), young);
+    uint64_t eused = heap->eused;
+    minor_gc();
+    res = pop_root();
+    assert(heap->eused - eused == 2);
+    assert(!is_young(car(res)));
+    assert(eq(car(car(res)), make_(FIXNUM, 7)));
+    typed_pointer var = insert_symbol("young-global");
+    define_var(var, cons(make_(FIXNUM, 8), empty_list));
+    set_var_val(var, cons(make_(FIXNUM, 9), empty_list));
+    assert(heap->gdirty.used == 1);
+    minor_gc();
+    assert(heap->gdirty.used == 0);
+    res = lookup_variable_value(var);
+    assert(!is_young(res) && eq(car(res), make_(FIXNUM, 9)));
+  }
+
+  if(!heap->compact) {
+    uint64_t threads = heap->threads;
+    heap->threads = 1;
+    res = empty_list;
+    for(int64_t i = 0; i < 1000; i++) {
+      res = cons(make_(FIXNUM, i), res);
+    }
+    push_root(res);
+    gc();
+    res = peek_root();
+    assert(is_cell(res));
+    assert(pair_index(cdr(res)) == pair_index(res) + 1);
+    set_cdr(cdr(res), cdr(cdr(cdr(res))));
+    for(int pass = 0; pass < 2; pass++) {
+      res = peek_root();
+      assert(eq(car(res), make_(FIXNUM, 999)));
+      assert(eq(car(cdr(res)), make_(FIXNUM, 998)));
+      res = cdr(cdr(res));
+      for(int64_t i = 996; i >= 0; i--) {
+        assert(eq(car(res), make_(FIXNUM, i)));
+        res = cdr(res);
+      }
+      assert(eq(res, empty_list));
+      gc();
+    }
+    pop_root();
+    heap->threads = threads;
+  }
+
+  heap_t *saved_heap = heap;
+  heap = make_heap(1024, 1 << 20, 0, false, 64);
+  heap->slice = 4;
+  bool collecting = false;
+  n = 4 * heap->esize;
+  res = empty_list;
+  for(int64_t i = 0; i < n; i++) {
+    res = cons(make_(FIXNUM, i), res);
+    collecting = collecting || heap->collecting;
+  }
+  assert(collecting);
+  push_root(res);
+  for(int64_t i = n - 1; i >= 0; i--) {
+    assert(eq(car(res), make_(FIXNUM, i)));
+    res = cdr(res);
+  }
+  gc();
+  res = pop_root();
+  assert(!heap->collecting);
+  for(int64_t i = n - 1; i >= 0; i--) {
+    assert(eq(car(res), make_(FIXNUM, i)));
+    res = cdr(res);
+  }
+  free_heap(heap);
+  heap = saved_heap;
+
+  saved_heap = heap;
+  heap = make_heap(1024, 1024, 0, true, 64);
+  res = empty_list;
+  for(int64_t i = 0; i < 100; i++) {
+    res = cons(make_(FIXNUM, i), res);
+    cons(res, res);
+  }
+  push_root(res);
+  gc();
+  res = pop_root();
+  assert(heap->eused == 200);
+  for(int64_t i = 99; i >= 0; i--) {
+    assert(eq(car(res), make_(FIXNUM, i)));
+    res = cdr(res);
+  }
+  assert(eq(res, empty_list));
+  free_heap(heap);
+  heap = saved_heap;
+
+  if(!heap->compact) {
+    uint64_t threads = heap->threads;
+    heap->threads = 4;
+    push_root(empty_list);
+    for(int64_t i = 0; i < PARALLEL_GC_MIN; i++) {
+      res = cons(make_(FIXNUM, i), make_(FIXNUM, i));
+      res = cons(res, pop_root());
+      push_root(res);
+    }
+    res = make_object(VECTOR_OBJECT, GC_LAB_SIZE / 2);
+    object_set(res, 0, peek_root());
+    push_root(res);
+    res = car(heap->gc_roots[heap->rused - 2]);
+    set_cdr(res, heap->gc_roots[heap->rused - 2]);
+    gc();
+    assert(gc_nworkers == 4);
+    heap->threads = 2;
+    gc();
+    assert(gc_nworkers == 2);
+    res = pop_root();
+    assert(eq(object_ref(res, 0), peek_root()));
+    res = peek_root();
+    for(int64_t i = PARALLEL_GC_MIN - 1; i >= 0; i--) {
+      assert(eq(car(car(res)), make_(FIXNUM, i)));
+      res = cdr(res);
+    }
+    res = pop_root();
+    assert(eq(cdr(car(res)), res));
+    heap->threads = threads;
+  }
+
+  res = make_object(VECTOR_OBJECT, 3);
+  push_root(res);
+  for(int64_t i = 0; i < 3; i++) {
+    typed_pointer e = cons(make_(FIXNUM, i), empty_list);
+    object_set(peek_root(), i, e);
+  }
+  gc();
+  res = pop_root();
+  r = sexp_to_str(res);
+  assert(strcmp(r, "#((0) (1) (2))") == 0);
   free(r);
+
+  res = make_object(VECTOR_OBJECT, LARGE_OBJECT_SIZE);
+  assert(is_large(res));
+  typed_pointer *slots = object_slots(res);
+  push_root(res);
+  for(int64_t i = 0; i < LARGE_OBJECT_SIZE; i++) {
+    typed_pointer e = cons(make_(FIXNUM, i), empty_list);
+    object_set(peek_root(), i, e);
+  }
+  make_object(VECTOR_OBJECT, LARGE_OBJECT_SIZE);
+  gc();
+  res = pop_root();
+  assert(object_slots(res) == slots);
+  assert(heap->lelems == LARGE_OBJECT_SIZE + 1);
+  for(int64_t i = 0; i < LARGE_OBJECT_SIZE; i++) {
+    assert(eq(car(object_ref(res, i)), make_(FIXNUM, i)));
+  }
+
+  saved_heap = heap;
+  heap = make_heap(1024, 1024, 0, true, 64);
+  make_object(VECTOR_OBJECT, 5);
+  push_root(make_record(record_symbol, 2));
+  record_set(peek_root(), 0, cons(make_(FIXNUM, 1), empty_list));
+  record_set(peek_root(), 1, peek_root());
+  gc();
+  res = pop_root();
+  assert(heap->eused == 6);
+  assert(eq(record_type(res), record_symbol));
+  assert(eq(car(record_ref(res, 0)), make_(FIXNUM, 1)));
+  assert(eq(record_ref(res, 1), res));
+  free_heap(heap);
+  heap = saved_heap;
+  assert(gc_nworkers == 0);
+
+  saved_heap = heap;
+  heap = make_heap(1024, 1 << 20, 0, false, 64);
+  assert(map_heap(heap, NO_HUGE_PAGES));
+  res = empty_list;
+  for(int64_t i = 0; i < 100000; i++) {
+    push_root(cons(make_(FIXNUM, i), res));
+    cons(peek_root(), peek_root());
+    res = pop_root();
+  }
+  push_root(res);
+  gc();
+  res = pop_root();
+  assert(heap->esize >= 1 << 17);
+  for(int64_t i = 99999; i >= 0; i--) {
+    assert(eq(car(res), make_(FIXNUM, i)));
+    res = cdr(res);
+  }
+  assert(eq(res, empty_list));
+  free_heap(heap);
+  heap = saved_heap;
 }